@@ -11,6 +11,27 @@
 
 // TODO: Implement SGI (Software Generated Interrupts) for multicore
 
+// Emitted by the user copy routines, both fields are relative to themselves
+typedef struct exception_table_entry {
+    i32 insn;
+    i32 fixup;
+} exception_table_entry_t;
+
+extern exception_table_entry_t __start___ex_table[];
+extern exception_table_entry_t __stop___ex_table[];
+
+// Redirects a faulting user access to its fixup, false if elr is not one
+static bool fixup_exception(trapframe_t *tf) {
+    for (exception_table_entry_t *e = __start___ex_table; e < __stop___ex_table; e++) {
+        if ((u64)&e->insn + e->insn == tf->elr) {
+            tf->elr = (u64)&e->fixup + e->fixup;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void dump_stack() {
     uint64_t fp;
     
@@ -47,10 +68,10 @@ void el1_sync_handler(trapframe_t *tf) {
             tf->elr += 4;
             schedule();
             break;
-        case 0x20:  // Instruction Abort (Higher EL)
-        case 0x21:  // Data Abort   (Higher EL)
-        case 0x24:  // Instruction Abort (Lower EL)
-        case 0x25:  // Data Abort   (Lower EL)
+        case 0x20:  // Instruction Abort (Lower EL)
+        case 0x21:  // Instruction Abort (Same EL)
+        case 0x24:  // Data Abort   (Lower EL)
+        case 0x25:  // Data Abort   (Same EL)
             u8 fsc = iss & 0x3F;
             
             // Extract Write flag (Bit 6 of ISS for Data Aborts)
@@ -64,6 +85,9 @@ void el1_sync_handler(trapframe_t *tf) {
                 if (is_write && vmm_handle_page_fault(far, true) == 0) return;
             }
 
+            // A kernel user copy hit a bad address, fail the copy instead of the process
+            if (ec == 0x25 && fixup_exception(tf)) return;
+
             if (current_task->proc) {
                 extern i64 sys_kill(i64 pid, int sig);
                 sys_kill(current_task->proc->pid, SIGSEGV);
@@ -9,9 +9,12 @@
 #include <pmm.h>
 #include <vmm.h>
 #include <heap.h>
+#include <vmalloc.h>
 #include <dtb.h>
 #include <kernel.h>
 #include <sched.h>
+#include <vma.h>
+#include <asid.h>
 #include <virtio.h>
 #include <pl031.h>
 #include <io.h>
@@ -68,9 +71,7 @@ void signature() {
 }
 
 void secondary_main() {
-    u64 mpidr;
-    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
-    u32 cpu_id = mpidr & 0xFF;
+    u32 cpu_id = smp_cpu_id();
     
     // Set per-core pointer
     asm volatile("msr tpidr_el1, %0" :: "r"(&cores[cpu_id]));
@@ -80,6 +81,10 @@ void secondary_main() {
 
     irq_enable();
     kprintf("[ [CSMP [W] CPU %d booted successfully!\n", cpu_id);
+
+#ifdef PMM_BENCH
+    pmm_benchmark();
+#endif
     
     extern void idle();
     idle();
@@ -173,13 +178,10 @@ void main() {
     asm volatile("msr VBAR_EL1, %0" :: "r"(vbar_high));
     asm volatile("isb");
 
-    extern u32 *frame_stack;
-    extern u8 *ref_counts;
     extern u64* root_table;
     extern u64 root_phys;
 
-    frame_stack = (u32*)((uintptr_t)frame_stack + PHYS_OFFSET);
-    ref_counts = (u8*)((uintptr_t)ref_counts + PHYS_OFFSET);
+    pmm_relocate(PHYS_OFFSET);
 
     root_table = (u64*)((uintptr_t)root_phys + PHYS_OFFSET);
 
@@ -193,7 +195,10 @@ void main() {
     kprintf("[MAIN] Exception Level: %d\n", level);
     virtio_blk_ops_init();
 
-    heap_init(PHYS_OFFSET + 0x50000000, 8 * 1024 * 1024);
+    heap_init();
+    vma_init();
+    asid_init();
+    vmalloc_init();
 
     uart = (u8*)dtb_get_reg("pl011");
     gic  = (u64*)dtb_get_reg("intc");
@@ -212,6 +217,9 @@ void main() {
     
     asm volatile("msr tpidr_el1, %0" :: "r"(&cores[0]));
     smp_boot_cores();
+#ifdef PMM_BENCH
+    pmm_benchmark();
+#endif
     sched_init();
 
     gic_init();
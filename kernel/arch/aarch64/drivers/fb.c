@@ -96,17 +96,13 @@ static i64 fb_mmap(inode_t *node, u64 vaddr, u64 length, int prot, int flags, u6
     
     length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
+    rwsem_write_acquire(&mm->mmap_lock);
+    
     if (vaddr == 0) {
-        vaddr = mm->mmap_base;
-        vma_t *vma = mm->vma_list;
-        while (vma) {
-            if (vaddr + length <= vma->vm_start)
-                break;
-            
-            if (vaddr < vma->vm_end)
-                vaddr = vma->vm_end;
-            
-            vma = vma->vm_next;
+        vaddr = vma_tree_unmapped_area(mm, mm->mmap_base, length);
+        if (!vaddr) {
+            rwsem_write_release(&mm->mmap_lock);
+            return -1;
         }
     }
     
@@ -123,37 +119,26 @@ static i64 fb_mmap(inode_t *node, u64 vaddr, u64 length, int prot, int flags, u6
     vma_t *new_vma = vma_create(vaddr, vaddr + length, vma_flags, VMA_DEVICE);
     if (!new_vma) {
         kprintf("[FB] mmap: vma_create failed\n");
+        rwsem_write_release(&mm->mmap_lock);
         return -1;
     }
     
-    if (vma_insert(mm, new_vma) < 0) {
+    if (vma_insert_locked(mm, new_vma) < 0) {
         kprintf("[FB] mmap: vma_insert failed\n");
-        kfree(new_vma);
+        rwsem_write_release(&mm->mmap_lock);
+        vma_free(new_vma);
         return -1;
     }
     
     u64 *user_pt = (u64*)P2V((uintptr_t)mm->page_table);
     
-    for (u64 off = 0; off < length; off += PAGE_SIZE) {
-        u64 phys = fb_phys_addr + offset + off;
-        u64 virt = vaddr + off;
-        
-        u64 *pte = vmm_get_pte_from_table_alloc(user_pt, virt);
-        if (!pte) {
-            kprintf("[FB] mmap: pte alloc failed at virt=0x%lx\n", virt);
-            return -1;
-        }
-        
-        u64 entry = (phys & 0x0000FFFFFFFFF000ULL);
-        entry |= PT_VALID | PT_PAGE | PT_AF;
-        entry |= PT_SH_INNER;
-        entry |= (1ULL << 2);
-        entry |= PT_AP_RW_EL0;
-        entry |= PT_UXN | PT_PXN;
-        
-        *pte = entry;   
+    if (vmm_map_range(user_pt, vaddr, fb_phys_addr + offset, length, VM_USER | VM_WRITABLE | VM_NO_EXEC) < 0) {
+        kprintf("[FB] mmap: pte alloc failed at virt=0x%lx\n", vaddr);
+        rwsem_write_release(&mm->mmap_lock);
+        return -1;
     }
     
+    rwsem_write_release(&mm->mmap_lock);
     return (i64)vaddr;
 }
 
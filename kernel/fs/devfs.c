@@ -27,7 +27,7 @@ static unsigned long devfs_next_id = 0x80000000ULL;
 static inode_t *create_device_inode(device_driver_t *device) {
     if (!device) goto done;
 
-    inode_t *node = (inode_t*)kmalloc(sizeof(inode_t));
+    inode_t *node = (inode_t*)kmem_cache_alloc(inode_cache);
     if (!node) goto done;
 
     memset(node, 0, sizeof(inode_t));
@@ -1,6 +1,7 @@
 #include <elf.h>
 #include <vfs.h>
 #include <heap.h>
+#include <vmalloc.h>
 #include <pmm.h>
 #include <vmm.h>
 #include <vma.h>
@@ -129,21 +130,19 @@ int elf_load(mm_struct_t* mm, const u8* data, size_t size, elf_load_result_t* re
         }
 
         if (vma_insert(mm, vma) < 0) {
-            kfree(vma);
+            vma_free(vma);
             kprintf("[ [RELF [W] Failed to insert VMA for segment %d\n", i);
             return -1;
         }
 
         // Allocate and map pages
         for (u64 addr = vaddr_start; addr < vaddr_end; addr += PAGE_SIZE) {
-            u64 phys = pmm_alloc_frame();
+            u64 phys = pmm_alloc_zeroed_frame();
             if (!phys) {
                 kprintf("[ [RELF [W] Out of memory loading segment %d\n", i);
                 return -1;
             }
 
-            memset(P2V(phys), 0, PAGE_SIZE);
-
             u64* pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)mm->page_table), addr);
             if (!pte) {
                 pmm_free_frame(phys);
@@ -151,7 +150,7 @@ int elf_load(mm_struct_t* mm, const u8* data, size_t size, elf_load_result_t* re
                 return -1;
             }
 
-            u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
+            u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER | PT_NG;
             entry |= (MT_NORMAL << 2);  // Normal memory
             entry |= PT_AP_RW_EL0;      // User accessible
 
@@ -222,7 +221,7 @@ int elf_load_from_file(mm_struct_t* mm, inode_t* file, elf_load_result_t* result
         return -1;
     }
 
-    u8* buffer = (u8*)kmalloc(file_size);
+    u8* buffer = (u8*)vmalloc(file_size);
     if (!buffer) {
         kprintf("[ [RELF [W] Failed to allocate buffer for ELF file\n");
         return -1;
@@ -233,12 +232,12 @@ int elf_load_from_file(mm_struct_t* mm, inode_t* file, elf_load_result_t* result
         kprintf("[ [RELF [W] Failed to read complete file: %llu/%llu\n", 
                 bytes_read, file_size);
         
-        kfree(buffer);
+        vfree(buffer);
         return -1;
     }
 
     int ret = elf_load(mm, buffer, file_size, result);
 
-    kfree(buffer);
+    vfree(buffer);
     return ret;
 }
\ No newline at end of file
@@ -523,7 +523,7 @@ inode_t* fat32_lookup(inode_t* node, const char* name) {
             to_upper(upper_entry);
 
             if (strcmp(search_name, upper_entry) == 0) {
-                result = kmalloc(sizeof(inode_t));
+                result = kmem_cache_alloc(inode_cache);
                 memset(result, 0, sizeof(inode_t));
                 strncpy(result->name, entry_name, sizeof(result->name) - 1);
                 
@@ -909,10 +909,10 @@ static inode_t* fat32_create_entry(inode_t* parent, const char* name, u8 attr) {
     }
     
     // Create and return inode
-    inode_t* node = kmalloc(sizeof(inode_t));
+    inode_t* node = kmem_cache_alloc(inode_cache);
 
     if (!node) {
-        kfree(node);
+        kmem_cache_free(inode_cache, node);
         kfree(entries);
         kprintf("[ [RFAT32 [W] Allocation fail: node\n");
         return NULL;
@@ -932,7 +932,7 @@ static inode_t* fat32_create_entry(inode_t* parent, const char* name, u8 attr) {
     fat32_file_t* file_data = kmalloc(sizeof(fat32_file_t));
 
     if (!file_data) {
-        kfree(node);
+        kmem_cache_free(inode_cache, node);
         kfree(entries);
         kfree(file_data);
         kprintf("[ [RFAT32 [W] Allocation fail: node\n");
@@ -1126,12 +1126,12 @@ int fat32_unlink(inode_t* parent, const char* name) {
     
     if (target->flags & FS_DIRECTORY) {
         kfree(target->ptr);
-        kfree(target);
+        kmem_cache_free(inode_cache, target);
         return -1;  // Can't unlink directory
     }
     
     kfree(target->ptr);
-    kfree(target);
+    kmem_cache_free(inode_cache, target);
     
     return delete_dir_entries(fs, parent_info->first_cluster, name) ? 0 : -1;
 }
@@ -1146,7 +1146,7 @@ int fat32_rmdir(inode_t* parent, const char* name) {
     
     if (!(target->flags & FS_DIRECTORY)) {
         kfree(target->ptr);
-        kfree(target);
+        kmem_cache_free(inode_cache, target);
         return -1;  // Not a directory
     }
     
@@ -1155,12 +1155,12 @@ int fat32_rmdir(inode_t* parent, const char* name) {
     // Check if empty
     if (!is_directory_empty(fs, target_info->first_cluster)) {
         kfree(target->ptr);
-        kfree(target);
+        kmem_cache_free(inode_cache, target);
         return -1;  // Directory not empty
     }
     
     kfree(target->ptr);
-    kfree(target);
+    kmem_cache_free(inode_cache, target);
     
     return delete_dir_entries(fs, parent_info->first_cluster, name) ? 0 : -1;
 }
@@ -1324,7 +1324,7 @@ inode_t* fat32_mount(inode_t* device) {
     kprintf("[ [CFAT32 [W] Mount Success. Root Cluster: %d, Total Clusters: %d\n", 
             fs->root_cluster, fs->total_clusters);
 
-    inode_t* root = kmalloc(sizeof(inode_t));
+    inode_t* root = kmem_cache_alloc(inode_cache);
     memset(root, 0, sizeof(inode_t));
     strcpy(root->name, "/");
     root->flags = FS_DIRECTORY;
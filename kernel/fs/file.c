@@ -3,6 +3,12 @@
 #include <sched.h>
 #include <kio.h>
 
+static kmem_cache_t *file_cache = NULL;
+
+void file_init() {
+    file_cache = kmem_cache_create("file_t", sizeof(file_t), 0, NULL);
+}
+
 int fd_alloc() {
     // Not having a process means that it is a kernel thread
     if (!current_task || !current_task->proc) return -1;
@@ -24,7 +30,7 @@ void fd_free(int fd) {
 }
 
 file_t* file_new(inode_t* inode, u32 flags) {
-    file_t* file = (file_t*)kmalloc(sizeof(file_t));
+    file_t* file = (file_t*)kmem_cache_alloc(file_cache);
     if (!file) return NULL;
 
     file->inode = inode;
@@ -46,7 +52,7 @@ void file_close(file_t* file) {
     if (file->ref_count <= 0) {
         // Trigger VFS close hook
         vfs_close(file->inode);
-        kfree(file);
+        kmem_cache_free(file_cache, file);
     }
 }
 
@@ -5,6 +5,7 @@
 #include <sched.h>
 #include <pmm.h>
 #include <vmm.h>
+#include <spinlock.h>
 
 #define MAX_MOUNTS 16
 #define MAX_SYMLINK_DEPTH 8
@@ -20,6 +21,7 @@ struct mount_entry {
 } mount_table[MAX_MOUNTS];
 
 inode_t *vfs_root = NULL;
+kmem_cache_t *inode_cache = NULL;
 
 typedef struct page_cache_entry {
     inode_t *node;
@@ -35,6 +37,11 @@ static page_cache_entry_t *page_cache[CACHE_BUCKETS];
 static page_cache_entry_t *lru_head = NULL;
 static page_cache_entry_t *lru_tail = NULL;
 static u32 current_cached_pages = 0;
+static kmem_cache_t *page_cache_entry_cache = NULL;
+
+// Covers the hash chains, the LRU, entry fields and the page count. Disk I/O
+// always happens with it dropped.
+static spinlock_t cache_lock = 0;
 
 static void lru_remove(page_cache_entry_t *entry) {
     if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
@@ -63,75 +70,118 @@ static int hash_cache(inode_t *node, u64 offset) {
     return (((uintptr_t)node >> 4) ^ (offset >> PAGE_SHIFT)) % CACHE_BUCKETS;
 }
 
-static void cache_evict_one() {
-    if (!lru_tail) return;
-    
-    page_cache_entry_t *evict = lru_tail;
-    
-    // WRITE-BACK: Flush to disk if the page was modified
-    if (evict->dirty && evict->node && evict->node->ops && evict->node->ops->write) {
-        u64 write_size = PAGE_SIZE;
-        if (evict->page_offset + PAGE_SIZE > evict->node->size)
-            write_size = evict->node->size - evict->page_offset;
-        
-        evict->node->ops->write(evict->node, evict->page_offset, write_size, (u8*)P2V(evict->phys_addr));
-    }
+// Frames with references beyond the cache's own are mapped by user PTEs or being
+// copied by a reader, eviction leaves them alone
+static bool cache_busy(page_cache_entry_t *entry) {
+    return pmm_get_ref(entry->phys_addr) > 1;
+}
+
+// Hands out the entry's frame with an extra reference, map also counts a user PTE
+static uintptr_t cache_hold(page_cache_entry_t *entry, bool map) {
+    pmm_inc_ref(entry->phys_addr);
+    if (map) page_map_inc(phys_to_page(entry->phys_addr));
+
+    return entry->phys_addr;
+}
 
-    int bucket = hash_cache(evict->node, evict->page_offset);
-    if (page_cache[bucket] == evict)
-        page_cache[bucket] = evict->next;
+// Unlinks an entry from its hash chain and the LRU and drops the cache's reference
+static void cache_remove(page_cache_entry_t *entry) {
+    int bucket = hash_cache(entry->node, entry->page_offset);
+    if (page_cache[bucket] == entry)
+        page_cache[bucket] = entry->next;
     
     else {
         page_cache_entry_t *curr = page_cache[bucket];
-        while (curr && curr->next != evict)
+        while (curr && curr->next != entry)
             curr = curr->next;
         
-        if (curr) curr->next = evict->next;
+        if (curr) curr->next = entry->next;
     }
 
-    lru_remove(evict);
-    pmm_free_frame(evict->phys_addr);
-    kfree(evict);
+    lru_remove(entry);
+    page_clear_flags(phys_to_page(entry->phys_addr), PG_PAGECACHE);
+    pmm_free_frame(entry->phys_addr);
+    kmem_cache_free(page_cache_entry_cache, entry);
     current_cached_pages--;
 }
 
+// Called with cache_lock held and always returns with it released, the disk write
+// can sleep. The extra frame reference keeps the entry cached until it is done, a
+// store that lands meanwhile marks it dirty again.
+static void cache_writeback(page_cache_entry_t *entry, u32 flags) {
+    inode_t *node = entry->node;
+    if (!entry->dirty || !node->ops || !node->ops->write) {
+        spinlock_release_irqrestore(&cache_lock, flags);
+        return;
+    }
+
+    u64 offset = entry->page_offset;
+    u64 write_size = PAGE_SIZE;
+    if (offset + PAGE_SIZE > node->size)
+        write_size = node->size - offset;
+
+    entry->dirty = false;
+    uintptr_t phys = cache_hold(entry, false);
+    spinlock_release_irqrestore(&cache_lock, flags);
+
+    node->ops->write(node, offset, write_size, (u8*)P2V(phys));
+    pmm_free_frame(phys);
+}
+
+// Called with cache_lock held, only clean idle pages go. Dirty ones are written
+// back by cache_reclaim() before the insert that needs the room.
+static void cache_evict_one() {
+    page_cache_entry_t *evict = lru_tail;
+    while (evict && (evict->dirty || cache_busy(evict)))
+        evict = evict->lru_prev;
+
+    if (evict) cache_remove(evict);
+}
+
+// Makes room ahead of an insert. If the oldest idle page is dirty it is flushed
+// here, with the lock dropped, so the insert can evict it.
+static void cache_reclaim() {
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
+    
+    page_cache_entry_t *entry = NULL;
+    if (current_cached_pages >= MAX_CACHED_PAGES) {
+        entry = lru_tail;
+        while (entry && cache_busy(entry))
+            entry = entry->lru_prev;
+    }
+
+    if (entry && entry->dirty)
+        cache_writeback(entry, flags);
+    else
+        spinlock_release_irqrestore(&cache_lock, flags);
+}
+
 static void cache_evict_inode(inode_t *node, bool flush_dirty) {
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
     page_cache_entry_t *curr = lru_head;
     
     while (curr) {
         page_cache_entry_t *next = curr->lru_next;
         
         if (curr->node == node) {
-            if (flush_dirty && curr->dirty && node->ops && node->ops->write) {
-                u64 write_size = PAGE_SIZE;
-                if (curr->page_offset + PAGE_SIZE > node->size)
-                    write_size = node->size - curr->page_offset;
-                
-                node->ops->write(node, curr->page_offset, write_size, (u8*)P2V(curr->phys_addr));
+            if (flush_dirty && curr->dirty) {
+                // The write drops the lock, start over once it is back
+                cache_writeback(curr, flags);
+                flags = spinlock_acquire_irqsave(&cache_lock);
+                curr = lru_head;
+                continue;
             }
 
-            int bucket = hash_cache(node, curr->page_offset);
-            if (page_cache[bucket] == curr)
-                page_cache[bucket] = curr->next;
-            
-            else {
-                page_cache_entry_t *hc = page_cache[bucket];
-                while (hc && hc->next != curr)
-                    hc = hc->next;
-                
-                if (hc) hc->next = curr->next;
-            }
-
-            lru_remove(curr);
-            pmm_free_frame(curr->phys_addr);
-            kfree(curr);
-            current_cached_pages--;
+            cache_remove(curr);
         }
 
         curr = next;
     }
+
+    spinlock_release_irqrestore(&cache_lock, flags);
 }
 
+// Called with cache_lock held
 static page_cache_entry_t *cache_lookup(inode_t *node, u64 offset) {
     int bucket = hash_cache(node, offset);
     page_cache_entry_t *entry = page_cache[bucket];
@@ -145,18 +195,20 @@ static page_cache_entry_t *cache_lookup(inode_t *node, u64 offset) {
     return NULL;
 }
 
+// Called with cache_lock held
 static page_cache_entry_t *cache_add(inode_t *node, u64 offset, uintptr_t phys_addr) {
     if (current_cached_pages >= MAX_CACHED_PAGES)
         cache_evict_one();
 
     int bucket = hash_cache(node, offset);
-    page_cache_entry_t *entry = (page_cache_entry_t *)kmalloc(sizeof(page_cache_entry_t));
+    page_cache_entry_t *entry = (page_cache_entry_t *)kmem_cache_alloc(page_cache_entry_cache);
     if (!entry) return NULL;
     
     entry->node = node;
     entry->page_offset = offset;
     entry->phys_addr = phys_addr;
     entry->dirty = false;
+    page_set_flags(phys_to_page(phys_addr), PG_PAGECACHE);
     
     entry->next = page_cache[bucket];
     page_cache[bucket] = entry;
@@ -167,9 +219,58 @@ static page_cache_entry_t *cache_add(inode_t *node, u64 offset, uintptr_t phys_a
     return entry;
 }
 
+// Caches frame, filled with the lock dropped, unless another thread cached the
+// page first. Returns whichever frame ended up cached with an extra reference,
+// frame itself is freed if it lost or the insert failed.
+static uintptr_t cache_insert(inode_t *node, u64 page_offset, uintptr_t frame, bool map) {
+    cache_reclaim();
+
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
+    page_cache_entry_t *entry = cache_lookup(node, page_offset);
+    if (entry) lru_touch(entry);
+    else entry = cache_add(node, page_offset, frame);
+
+    uintptr_t phys = entry ? cache_hold(entry, map) : 0;
+    spinlock_release_irqrestore(&cache_lock, flags);
+
+    if (phys != frame)
+        pmm_free_frame(frame);
+
+    return phys;
+}
+
+// Returns the frame caching a page aligned offset, reading it in on a miss. The
+// caller owns an extra reference and drops it with pmm_free_frame.
+static uintptr_t cache_get(inode_t *node, u64 page_offset, bool map) {
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
+    page_cache_entry_t *entry = cache_lookup(node, page_offset);
+    if (entry) {
+        lru_touch(entry); // Cache hit, move to front of LRU
+        uintptr_t phys = cache_hold(entry, map);
+        spinlock_release_irqrestore(&cache_lock, flags);
+        return phys;
+    }
+    spinlock_release_irqrestore(&cache_lock, flags);
+
+    uintptr_t frame = pmm_alloc_zeroed_frame();
+    if (!frame) return 0;
+
+    u64 disk_read_size = PAGE_SIZE;
+    if (page_offset + PAGE_SIZE > node->size)
+        disk_read_size = node->size - page_offset;
+
+    node->ops->read(node, page_offset, disk_read_size, (u8*)P2V(frame));
+
+    return cache_insert(node, page_offset, frame, map);
+}
+
 void vfs_init() {
     vfs_root = NULL;
     memset(mount_table, 0, sizeof(mount_table));
+
+    inode_cache = kmem_cache_create("inode_t", sizeof(inode_t), 0, NULL);
+    page_cache_entry_cache = kmem_cache_create("page_cache_entry_t", sizeof(page_cache_entry_t), 0, NULL);
+    file_init();
     kprintf("[ [CVFS [W] Virtual File System Initialized\n");
 }
 
@@ -247,28 +348,12 @@ u64 vfs_read(inode_t* node, u64 offset, u64 size, u8* buffer) {
         if (current_offset + bytes_to_read > node->size)
             bytes_to_read = node->size - current_offset;
 
-        page_cache_entry_t *entry = cache_lookup(node, page_offset);
-        if (entry) lru_touch(entry); // Cache hit, move to front of LRU
-        else {
-            uintptr_t frame = pmm_alloc_frame();
-            if (!frame) break;
-
-            u64 disk_read_size = PAGE_SIZE;
-            if (page_offset + PAGE_SIZE > node->size)
-                disk_read_size = node->size - page_offset;
-
-            memset((u8*)P2V(frame), 0, PAGE_SIZE);
-            node->ops->read(node, page_offset, disk_read_size, (u8*)P2V(frame));
+        uintptr_t phys = cache_get(node, page_offset, false);
+        if (!phys) break;
 
-            entry = cache_add(node, page_offset, frame);
-            if (!entry) {
-                pmm_free_frame(frame);
-                break;
-            }
-        }
-
-        // Copy from cached page to user/kernel buffer
-        memcpy(buffer + bytes_read, (u8*)P2V(entry->phys_addr) + offset_in_page, bytes_to_read);
+        // Copy from cached page to user/kernel buffer, our reference keeps it cached
+        memcpy(buffer + bytes_read, (u8*)P2V(phys) + offset_in_page, bytes_to_read);
+        pmm_free_frame(phys);
         bytes_read += bytes_to_read;
     }
 
@@ -295,9 +380,16 @@ u64 vfs_write(inode_t* node, u64 offset, u64 size, u8* buffer) {
         if (bytes_written + bytes_to_write > size)
             bytes_to_write = size - bytes_written;
 
+        u32 flags = spinlock_acquire_irqsave(&cache_lock);
         page_cache_entry_t *entry = cache_lookup(node, page_offset);
-        if (entry) lru_touch(entry);
-        else {
+        uintptr_t phys = 0;
+        if (entry) {
+            lru_touch(entry);
+            phys = cache_hold(entry, false);
+        }
+        spinlock_release_irqrestore(&cache_lock, flags);
+
+        if (!phys) {
             uintptr_t frame = pmm_alloc_frame();
             if (!frame) break;
 
@@ -310,15 +402,14 @@ u64 vfs_write(inode_t* node, u64 offset, u64 size, u8* buffer) {
                 node->ops->read(node, page_offset, disk_read_size, (u8*)P2V(frame));
             } else memset((u8*)P2V(frame), 0, PAGE_SIZE);
 
-            entry = cache_add(node, page_offset, frame);
-            if (!entry) {
-                pmm_free_frame(frame);
-                break;
-            }
+            phys = cache_insert(node, page_offset, frame, false);
+            if (!phys) break;
         }
 
-        memcpy((u8*)P2V(entry->phys_addr) + offset_in_page, buffer + bytes_written, bytes_to_write);
-        entry->dirty = true; 
+        // Dirty only once the data is in, a writeback racing the copy can't lose it
+        memcpy((u8*)P2V(phys) + offset_in_page, buffer + bytes_written, bytes_to_write);
+        vfs_dirty_page(node, page_offset);
+        pmm_free_frame(phys);
         
         bytes_written += bytes_to_write;
     }
@@ -329,6 +420,53 @@ u64 vfs_write(inode_t* node, u64 offset, u64 size, u8* buffer) {
     return bytes_written;
 }
 
+// Hands out the cached frame holding offset for a user PTE. The caller owns one
+// frame reference and one mapcount, which keeps the page from being evicted.
+// Returns 0 past EOF or for nodes that don't go through the cache.
+uintptr_t vfs_map_page(inode_t* node, u64 offset) {
+    if (!node || !node->ops || !node->ops->read || !S_ISREG(node->mode))
+        return 0;
+
+    if (offset >= node->size)
+        return 0;
+
+    // The reference and mapcount are taken under cache_lock, so eviction can't race them
+    return cache_get(node, offset & ~(PAGE_SIZE - 1), true);
+}
+
+// vfs_map_page without the read, returns 0 unless offset is already cached
+uintptr_t vfs_map_cached_page(inode_t* node, u64 offset) {
+    if (!node || !S_ISREG(node->mode) || offset >= node->size)
+        return 0;
+
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
+    page_cache_entry_t *entry = cache_lookup(node, offset & ~(PAGE_SIZE - 1));
+    uintptr_t phys = entry ? cache_hold(entry, true) : 0;
+    spinlock_release_irqrestore(&cache_lock, flags);
+
+    return phys;
+}
+
+// A shared mapping is about to write to the cached page at offset
+void vfs_dirty_page(inode_t* node, u64 offset) {
+    u32 flags = spinlock_acquire_irqsave(&cache_lock);
+    page_cache_entry_t *entry = cache_lookup(node, offset & ~(PAGE_SIZE - 1));
+    if (entry) entry->dirty = true;
+    spinlock_release_irqrestore(&cache_lock, flags);
+}
+
+// Writes the dirty cached pages of [offset, offset + size) back to the file
+void vfs_sync_range(inode_t* node, u64 offset, u64 size) {
+    if (!node || !S_ISREG(node->mode)) return;
+
+    for (u64 page = offset & ~(PAGE_SIZE - 1); page < offset + size && page < node->size; page += PAGE_SIZE) {
+        u32 flags = spinlock_acquire_irqsave(&cache_lock);
+        page_cache_entry_t *entry = cache_lookup(node, page);
+        if (entry) cache_writeback(entry, flags);
+        else spinlock_release_irqrestore(&cache_lock, flags);
+    }
+}
+
 void vfs_open(inode_t* node) {
     if (!node) return;
 
@@ -350,7 +488,7 @@ void vfs_close(inode_t* node) {
                 node->ops->close(node); // Free private driver data (fat32_file_t)
             
             if (node->flags & FS_TEMPORARY)
-                kfree(node); // Free the VFS node itself
+                kmem_cache_free(inode_cache, node); // Free the VFS node itself
         }
     }
 }
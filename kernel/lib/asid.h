@@ -0,0 +1,25 @@
+#ifndef ASID_H
+#define ASID_H
+
+#include <lib.h>
+#include <vma.h>
+
+// Address space IDs tag user TLB entries so a context switch does not need
+// to flush them. Every mm gets one lazily on its first switch, ASIDs are
+// recycled all at once by bumping the generation when they run out.
+void asid_init();
+void switch_mm(mm_struct_t* mm);
+
+// Moves this CPU off mm as it is torn down. CPUs that still borrow it keep a
+// reference, so its tables stay until the last of them switches away.
+void switch_mm_drop(mm_struct_t* mm);
+
+// Drops the owner's reference, true if no CPU holds mm and its tables can go
+bool switch_mm_put(mm_struct_t* mm);
+
+// Invalidate one user page or every user page of mm, on all cores
+void tlb_flush_mm_page(mm_struct_t* mm, uintptr_t addr);
+void tlb_flush_mm_range(mm_struct_t* mm, uintptr_t start, uintptr_t end);
+void tlb_flush_mm(mm_struct_t* mm);
+
+#endif
@@ -10,6 +10,7 @@ typedef struct file {
     int ref_count;
 } file_t;
 
+void file_init();
 int fd_alloc();
 void fd_free(int fd);
 file_t* file_new(inode_t* inode, u32 flags);
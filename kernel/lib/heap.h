@@ -3,13 +3,40 @@
 
 #include <lib.h>
 
-void heap_init(uintptr_t start, size_t size);
+void heap_init();
+
+// Requests larger than the PMM's biggest block come from vmalloc and may sleep
 void* kmalloc(size_t size);
 void* kcalloc(size_t num, size_t size);
 void* krealloc(void* ptr, size_t new_size);
 void kfree(void* ptr);
 
+#define CACHE_LINE_SIZE 64
+
+// Named caches of exact size objects. kfree() also accepts their objects.
+typedef struct kmem_cache kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *ptr);
+
 // Debugging
 void heap_debug();
 
+// Per call site kmalloc statistics, built with KMALLOC_PROFILE.
+// site is the caller's return address, resolve it against kernel.elf.
+typedef struct {
+    uintptr_t site;
+    u64 live_bytes;
+    u64 peak_bytes;
+    u64 allocs;
+    u64 frees;
+} kmalloc_site_t;
+
+#ifdef KMALLOC_PROFILE
+#define PROF_SITES      256     // Call sites tracked, kmalloc_profile_read never returns more
+
+u32 kmalloc_profile_read(kmalloc_site_t *out, u32 max);
+#endif
+
 #endif
\ No newline at end of file
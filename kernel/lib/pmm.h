@@ -12,10 +12,64 @@ extern u32 total_frames;
 #define PAGE_SIZE       4096ULL
 #define PAGE_SHIFT      12
 
+#define PMM_MAX_ORDER   10                     // Largest block: 2^10 frames (4MB)
+#define PMM_NO_FRAME    ((u32)-1)
+
+// page_t flags
+#define PG_BUDDY        (1 << 0)    // Heads a free buddy block
+#define PG_RESERVED     (1 << 1)    // Firmware, kernel image or boot reservation
+#define PG_DIRTY        (1 << 2)    // Contents differ from the backing store
+#define PG_LRU          (1 << 3)    // On a reclaim LRU list
+#define PG_PAGECACHE    (1 << 4)    // Owned by the VFS page cache
+#define PG_SLAB         (1 << 5)    // Kernel heap slab page
+#define PG_KMALLOC      (1 << 6)    // Kernel heap large allocation
+#define PG_HEAP_FREE    (1 << 7)    // Free page owned by the kernel heap
+
+// One descriptor per physical frame
+typedef struct page {
+    u32 refcount;       // References to the frame, frees at 0 (atomic)
+    u32 mapcount;       // User page table entries mapping the frame (atomic)
+    u32 flags;          // PG_* bits
+    u32 order;          // Buddy order when free, run length when owned by the heap
+    u32 next;           // Next free block of the same order, or heap run
+    u32 prev;           // Previous free block of the same order, or heap run
+    void *owner;        // Subsystem specific back pointer
+} page_t;
+
+extern page_t *pages;
+
 void pmm_init(uintptr_t kernel_end, u64 ram_size);
 uintptr_t pmm_alloc_frame();
+uintptr_t pmm_alloc_zeroed_frame();
+bool pmm_refill_zeroed();
+void pmm_relocate(uintptr_t offset);
 void pmm_free_frame(uintptr_t addr);
+uintptr_t pmm_alloc_pages(u32 order);
+void pmm_free_pages(uintptr_t addr, u32 order);
 void pmm_mark_used_region(uintptr_t base, size_t size);
 void pmm_inc_ref(uintptr_t phys);
+u32 pmm_get_ref(uintptr_t phys);
+page_t *phys_to_page(uintptr_t phys);
+uintptr_t page_to_phys(page_t *page);
+
+static inline void page_set_flags(page_t *page, u32 flags) {
+    __atomic_or_fetch(&page->flags, flags, __ATOMIC_RELAXED);
+}
+
+static inline void page_clear_flags(page_t *page, u32 flags) {
+    __atomic_and_fetch(&page->flags, ~flags, __ATOMIC_RELAXED);
+}
+
+static inline void page_map_inc(page_t *page) {
+    __atomic_add_fetch(&page->mapcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void page_map_dec(page_t *page) {
+    __atomic_sub_fetch(&page->mapcount, 1, __ATOMIC_RELAXED);
+}
+
+#ifdef PMM_BENCH
+void pmm_benchmark();
+#endif
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <file.h>
+#include <heap.h>
 
 #define MAX_FD 1024
 #define MAX_PROC 2000
@@ -154,6 +155,7 @@ typedef struct {
 } cpu_core_t;
 
 extern cpu_core_t cores[MAX_CPUS];
+extern kmem_cache_t *task_cache;
 
 void sched_init();
 void task_create(void (*entry_point)(), task_priority priority, struct process *proc);
@@ -172,6 +174,17 @@ void task_sleep_ticks(u64 ticks);
 int sleep_on_timeout(wait_queue_t* queue, u64 timeout_ticks);
 int psci_cpu_on(u64 target_cpu, u64 entry_point, u64 context_id);
 
+// Index of the running CPU in cores[], the affinity level 0 of its MPIDR
+static inline u32 smp_cpu_id() {
+#ifdef ARM
+    u64 mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xFF;
+#else
+    return 0;
+#endif
+}
+
 static inline cpu_core_t* get_core() {
     cpu_core_t* core;
     asm volatile("mrs %0, tpidr_el1" : "=r"(core));
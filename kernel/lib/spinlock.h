@@ -48,6 +48,22 @@ static inline void spinlock_release_irqrestore(spinlock_t *lock, u32 flags) {
     );
 }
 
+// Masks IRQs on this core only, for per-CPU data that needs no lock
+static inline u32 local_irq_save() {
+    u32 flags;
+    asm volatile(
+        "mrs %0, daif\n"
+        "msr daifset, #2\n"
+        : "=r" (flags)
+        :: "memory"
+    );
+    return flags;
+}
+
+static inline void local_irq_restore(u32 flags) {
+    asm volatile("msr daif, %0" :: "r" (flags) : "memory");
+}
+
 #else
 static inline u32 spinlock_acquire_irqsave(spinlock_t *lock) {
     u32 eflags;
@@ -64,6 +80,17 @@ static inline void spinlock_release_irqrestore(spinlock_t *lock, u32 flags) {
     __sync_lock_release(lock);
     asm volatile("push %0; popf" : : "r"(flags));
 }
+
+static inline u32 local_irq_save() {
+    u32 eflags;
+    asm volatile("pushf; pop %0" : "=r"(eflags));
+    asm volatile("cli");
+    return eflags;
+}
+
+static inline void local_irq_restore(u32 flags) {
+    asm volatile("push %0; popf" : : "r"(flags));
+}
 #endif
 
 #endif
\ No newline at end of file
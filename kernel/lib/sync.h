@@ -25,4 +25,18 @@ void mutex_init(mutex_t* mutex);
 void mutex_acquire(mutex_t* mutex);
 void mutex_release(mutex_t* mutex);
 
+typedef struct {
+    spinlock_t lock;        // Protects the fields below
+    int readers;            // Active readers
+    bool writer;            // 1 if a writer holds it
+    int writers_waiting;    // New readers back off while a writer waits
+    wait_queue_t wait_list; // List of blocked tasks
+} rwsem_t;
+
+void rwsem_init(rwsem_t* sem);
+void rwsem_read_acquire(rwsem_t* sem);
+void rwsem_read_release(rwsem_t* sem);
+void rwsem_write_acquire(rwsem_t* sem);
+void rwsem_write_release(rwsem_t* sem);
+
 #endif
\ No newline at end of file
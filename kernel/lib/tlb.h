@@ -0,0 +1,27 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <lib.h>
+#include <vma.h>
+
+#define TLB_GATHER_FRAMES   32      // Lives on 4KB kernel stacks, keep it small
+#define TLB_RANGE_PAGES     64      // Past this one ASID flush beats per-page TLBIs
+
+// Collects the user pages torn down or write-protected in one operation,
+// invalidates them with a single TLBI batch and only then frees the frames.
+typedef struct mmu_gather {
+    mm_struct_t* mm;
+    uintptr_t start;
+    uintptr_t end;
+    bool fullmm;                    // The whole address space is going away
+    u32 nr_frames;
+    u64 frames[TLB_GATHER_FRAMES];
+} mmu_gather_t;
+
+void tlb_gather_init(mmu_gather_t* tlb, mm_struct_t* mm, bool fullmm);
+void tlb_gather_page(mmu_gather_t* tlb, uintptr_t addr);
+void tlb_gather_free(mmu_gather_t* tlb, uintptr_t addr, u64 phys);
+void tlb_gather_flush(mmu_gather_t* tlb);
+void tlb_gather_finish(mmu_gather_t* tlb);
+
+#endif
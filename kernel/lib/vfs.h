@@ -2,6 +2,7 @@
 #define VFS_H
 
 #include <lib.h>
+#include <heap.h>
 
 #define FS_FILE        0x01
 #define FS_DIRECTORY   0x02
@@ -140,11 +141,16 @@ typedef struct vfs_node {
 } inode_t;
 
 extern inode_t *vfs_root;
+extern kmem_cache_t *inode_cache;
 
 void vfs_init();
 void vfs_retain(inode_t *node);
 u64 vfs_read(inode_t* node, u64 offset, u64 size, u8* buffer);
 u64 vfs_write(inode_t* node, u64 offset, u64 size, u8* buffer);
+uintptr_t vfs_map_page(inode_t* node, u64 offset);
+uintptr_t vfs_map_cached_page(inode_t* node, u64 offset);
+void vfs_dirty_page(inode_t* node, u64 offset);
+void vfs_sync_range(inode_t* node, u64 offset, u64 size);
 void vfs_open(inode_t* node);
 void vfs_close(inode_t* node);
 inode_t *vfs_create(inode_t *node, const char *name);
@@ -3,6 +3,7 @@
 
 #include <lib.h>
 #include <vfs.h>
+#include <sync.h>
 
 #define VMA_READ    (1 << 0)
 #define VMA_WRITE   (1 << 1)
@@ -11,6 +12,8 @@
 #define VMA_FIXED   (1 << 4)  // Fixed address mapping
 #define VMA_GROWSUP (1 << 5)  // Stack grows up
 #define VMA_GROWSDN (1 << 6)  // Stack grows down
+#define VMA_SEQ_READ  (1 << 7)  // madvise(MADV_SEQUENTIAL), wider fault-around
+#define VMA_RAND_READ (1 << 8)  // madvise(MADV_RANDOM), no fault-around
 
 #define VMA_ANONYMOUS 0  // Anonymous memory (heap, stack)
 #define VMA_FILE      1  // File-backed mapping
@@ -24,19 +27,36 @@ typedef struct vma_struct {
     
     // For file-backed mappings
     struct vfs_node* vm_file;  // File backing this VMA
-    u64 vm_pgoff;              // Offset in file (in pages)
+    u64 vm_pgoff;              // Offset in file (in bytes)
     
     struct vma_struct* vm_next;
+    struct vma_struct* vm_prev;
+
+    // Balanced tree by vm_start, see mm/vma_tree.c
+    struct vma_struct* vm_left;
+    struct vma_struct* vm_right;
+    struct vma_struct* vm_parent;
+    int vm_height;
+    uintptr_t vm_gap;          // Free space between the previous VMA and vm_start
+    uintptr_t vm_subtree_gap;  // Largest vm_gap in this subtree
 } vma_t;
 
 // Address space structure
 typedef struct mm_struct {
     u64* page_table;           // Root page table (physical address for TTBR)
-    vma_t* vma_list;           // List of VMAs
+    vma_t* vma_list;           // List of VMAs, sorted by address
+    vma_t* vma_root;           // Same VMAs as a tree, for lookups and gap search
     uintptr_t heap_start;      // Start of heap
     uintptr_t heap_end;        // Current heap end
     uintptr_t stack_start;     // Stack top
     uintptr_t mmap_base;       // Base for mmap allocations
+    u64 context_id;            // ASID generation | ASID, 0 until first switch
+    u32 ttbr_users;            // Owner plus CPUs whose TTBR0 points here, under asid_lock
+
+    // Faults take mmap_lock for reading, map/unmap/fork for writing.
+    // Concurrent faults serialize PTE updates on page_table_lock.
+    rwsem_t mmap_lock;
+    spinlock_t page_table_lock;
 } mm_struct_t;
 
 // User space layout (39-bit address space)
@@ -47,16 +67,40 @@ typedef struct mm_struct {
 #define USER_HEAP_START   0x0000000010000000ULL  // 256MB
 #define USER_MMAP_BASE    0x0000002000000000ULL  // 128GB
 
+// Read faults also map the not yet present pages of the surrounding aligned
+// window. Power of two up to 512 pages, 0 or 1 turns it off (sysctl vm.fault_around)
+#define FAULT_AROUND_PAGES 16
+
+extern u32 fault_around_pages;
+extern u64 fault_around_avoided;   // Pages mapped ahead of a fault
+
+void vma_init();
 mm_struct_t* mm_create();
 void mm_destroy(mm_struct_t* mm);
+void mm_free_tables(mm_struct_t* mm);
 vma_t* vma_create(uintptr_t start, uintptr_t end, u32 flags, u8 type);
+void vma_free(vma_t* vma);
 int vma_insert(mm_struct_t* mm, vma_t* vma);
+int vma_insert_locked(mm_struct_t* mm, vma_t* vma);
 vma_t* vma_find(mm_struct_t* mm, uintptr_t addr);
 int vma_unmap(mm_struct_t* mm, uintptr_t start, uintptr_t end);
 uintptr_t vma_allocate(mm_struct_t* mm, uintptr_t addr, size_t length, u32 flags);
 uintptr_t vma_allocate_file(mm_struct_t* mm, uintptr_t addr, size_t length, u32 flags, void* file, u64 offset);
 int vma_page_fault(mm_struct_t* mm, uintptr_t addr, bool is_write);
+int vma_sync(mm_struct_t* mm, uintptr_t start, uintptr_t end);
+int copy_to_mm(mm_struct_t* mm, uintptr_t user_dst, const void* kernel_src, size_t size);
+int vma_set_access_hint(mm_struct_t* mm, uintptr_t start, uintptr_t end, u32 hint);
+int vma_populate(mm_struct_t* mm, uintptr_t start, uintptr_t end);
+int vma_discard(mm_struct_t* mm, uintptr_t start, uintptr_t end);
 int vma_expand_stack(mm_struct_t* mm, uintptr_t addr);
 mm_struct_t* mm_duplicate(mm_struct_t* old_mm);
 
+// Tree primitives, callers hold mm->mmap_lock
+void vma_tree_insert(mm_struct_t* mm, vma_t* vma);
+void vma_tree_remove(mm_struct_t* mm, vma_t* vma);
+void vma_tree_update(mm_struct_t* mm, vma_t* vma);
+vma_t* vma_tree_find(mm_struct_t* mm, uintptr_t addr);
+vma_t* vma_tree_find_next(mm_struct_t* mm, uintptr_t addr);
+uintptr_t vma_tree_unmapped_area(mm_struct_t* mm, uintptr_t low, size_t length);
+
 #endif
\ No newline at end of file
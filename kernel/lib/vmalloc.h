@@ -0,0 +1,19 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <lib.h>
+#include <vmm.h>
+
+// Virtually contiguous kernel memory, for buffers too large to find physically
+// contiguous. Not usable for DMA. The area list is under a spinlock but the pages
+// are mapped under vmm_lock, a mutex, so callers must be able to sleep.
+void vmalloc_init();
+void* vmalloc(size_t size);
+void vfree(void* ptr);
+size_t vmalloc_size(const void* ptr);
+
+static inline bool is_vmalloc_addr(const void* ptr) {
+    return (uintptr_t)ptr >= VMALLOC_START && (uintptr_t)ptr < VMALLOC_END;
+}
+
+#endif
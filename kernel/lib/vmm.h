@@ -6,10 +6,18 @@
 #define PAGE_SIZE   4096ULL
 #define PAGE_SHIFT  12
 
+// Span covered by one L1 / L2 entry
+#define L1_BLOCK_SIZE   (1ULL << 30)
+#define L2_BLOCK_SIZE   (1ULL << 21)
+
 #define PHYS_OFFSET 0xFFFFFF8000000000ULL
 #define V2P(x) ((uintptr_t)(x) >= PHYS_OFFSET ? (uintptr_t)(x) - PHYS_OFFSET : (uintptr_t)(x))
 #define P2V(x) ((void*)((uintptr_t)(x) + PHYS_OFFSET))
 
+// Kernel virtual area for vmalloc, well past the linear map of RAM
+#define VMALLOC_START   (PHYS_OFFSET + 0x4000000000ULL)
+#define VMALLOC_END     (PHYS_OFFSET + 0x5000000000ULL)
+
 #ifdef ARM
 // Standard AArch64 Page Table Flags
 #define PT_VALID    (1ULL << 0)
@@ -19,6 +27,7 @@
 
 #define PT_AF       (1ULL << 10) // Access Flag
 #define PT_SH_INNER (3ULL << 8)  // Inner Shareable
+#define PT_NG       (1ULL << 11) // Not Global, tagged with the ASID
 #define PT_SW_COW   (1ULL << 55)
 
 #define MT_NORMAL        1
@@ -39,6 +48,11 @@
 void init_vmm();
 void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags);
 void vmm_map_region(uintptr_t virt, uintptr_t phys, size_t size, u64 flags);
+void vmm_map_linear(uintptr_t virt, uintptr_t phys, size_t size, u64 flags);
+uintptr_t vmm_unmap_page(uintptr_t virt);
+void vmm_unmap_region(uintptr_t virt, size_t size);
+int vmm_map_range(u64* page_table, uintptr_t virt, uintptr_t phys, size_t size, u64 flags);
+size_t vmm_unmap_range(u64* page_table, uintptr_t virt, size_t size);
 void dcache_clean_poc(void *addr, size_t size);
 int vmm_handle_page_fault(uintptr_t virt, bool is_write);
 
@@ -0,0 +1,228 @@
+#include <asid.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <spinlock.h>
+#include <sched.h>
+#include <string.h>
+#include <kio.h>
+
+#define ASID_MAX_BITS   16
+#define TCR_AS          (1ULL << 36)    // 16-bit ASIDs in TTBRx_EL1[63:48]
+#define TTBR_ASID_SHIFT 48
+
+// mm->context_id holds generation | asid, the generation lives above asid_bits
+static u32 asid_bits = 8;
+static u64 asid_generation;
+static u64 asid_map[(1 << ASID_MAX_BITS) / 64];
+static u64 asid_next = 1;
+static u64 active_asids[MAX_CPUS];
+static u64 reserved_asids[MAX_CPUS];
+static u32 flush_pending = 0;           // Per-CPU bit, set on rollover
+static mm_struct_t* cpu_mm[MAX_CPUS];   // What TTBR0 points to, kernel threads borrow it
+static u64 empty_ttbr0 = 0;             // Zeroed table for CPUs whose mm went away
+static spinlock_t asid_lock = 0;
+
+#define ASID_MASK       ((1ULL << asid_bits) - 1)
+#define ASID_FIRST_GEN  (1ULL << asid_bits)
+
+void asid_init() {
+#ifdef ARM
+    u64 tcr;
+    asm volatile("mrs %0, tcr_el1" : "=r"(tcr));
+    if (tcr & TCR_AS) asid_bits = 16;
+#endif
+
+    // The boot identity map is global and aliases user addresses,
+    // so every CPU flushes before its first user switch
+    asid_generation = ASID_FIRST_GEN;
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;                    // ASID 0 stays with the kernel tables
+    flush_pending = (1U << MAX_CPUS) - 1;
+
+    empty_ttbr0 = pmm_alloc_zeroed_frame();
+
+    kprintf("[ [CASID [W] %u-bit ASIDs\n", asid_bits);
+}
+
+static inline bool asid_test(u64 asid) {
+    return asid_map[asid / 64] & (1ULL << (asid % 64));
+}
+
+static inline void asid_set(u64 asid) {
+    asid_map[asid / 64] |= 1ULL << (asid % 64);
+}
+
+// Starts a new generation, keeping the ASIDs live on other CPUs
+static void asid_rollover() {
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        u64 asid = active_asids[cpu];
+        active_asids[cpu] = 0;
+
+        // A CPU that has not switched since the last rollover still runs its reserved one
+        if (asid == 0) asid = reserved_asids[cpu];
+
+        reserved_asids[cpu] = asid;
+        if (asid) asid_set(asid & ASID_MASK);
+    }
+
+    asid_generation += ASID_FIRST_GEN;
+    asid_next = 1;
+    flush_pending = (1U << MAX_CPUS) - 1;
+}
+
+static u64 asid_new_context(mm_struct_t* mm) {
+    u64 asid = mm->context_id & ASID_MASK;
+
+    if (asid) {
+        // Still running somewhere across the rollover, carry it into the new generation
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (reserved_asids[cpu] == mm->context_id) {
+                u64 id = asid_generation | asid;
+                reserved_asids[cpu] = id;
+                return id;
+            }
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (u64 a = asid_next; a <= ASID_MASK; a++) {
+            if (!asid_test(a)) {
+                asid_set(a);
+                asid_next = a + 1;
+                return asid_generation | a;
+            }
+        }
+
+        asid_rollover();
+    }
+
+    // Unreachable, a fresh generation always has a free ASID
+    return asid_generation;
+}
+
+void switch_mm(mm_struct_t* mm) {
+    if (!mm) return;
+
+    u32 cpu = smp_cpu_id();
+
+    // Same mm as last time, or back from a kernel thread that borrowed it.
+    // A racing rollover keeps this ASID reserved, so skipping is safe.
+    if (cpu_mm[cpu] == mm &&
+        !((__atomic_load_n(&mm->context_id, __ATOMIC_RELAXED) ^
+           __atomic_load_n(&asid_generation, __ATOMIC_RELAXED)) >> asid_bits) &&
+        !(__atomic_load_n(&flush_pending, __ATOMIC_RELAXED) & (1U << cpu)))
+        return;
+
+    u32 flags = spinlock_acquire_irqsave(&asid_lock);
+
+    if ((mm->context_id ^ asid_generation) >> asid_bits)
+        mm->context_id = asid_new_context(mm);
+
+    bool flush = flush_pending & (1U << cpu);
+    flush_pending &= ~(1U << cpu);
+    active_asids[cpu] = mm->context_id;
+
+    // TTBR0 keeps the previous mm's tables live until it is reloaded below
+    mm_struct_t* prev = cpu_mm[cpu];
+    bool free_prev = false;
+    if (prev != mm) {
+        mm->ttbr_users++;
+        if (prev) free_prev = --prev->ttbr_users == 0;
+        cpu_mm[cpu] = mm;
+    }
+
+    u64 ttbr = (u64)mm->page_table | ((mm->context_id & ASID_MASK) << TTBR_ASID_SHIFT);
+
+    spinlock_release_irqrestore(&asid_lock, flags);
+
+#ifdef ARM
+    asm volatile("msr ttbr0_el1, %0\n"
+                 "isb\n"
+                 :: "r"(ttbr) : "memory");
+
+    if (flush) {
+        asm volatile("tlbi vmalle1\n"
+                     "dsb nsh\n"
+                     "isb\n"
+                     ::: "memory");
+    }
+#else
+    (void)ttbr;
+    (void)flush;
+#endif
+
+    // We were the last CPU on an mm that has been destroyed
+    if (free_prev) mm_free_tables(prev);
+}
+
+void switch_mm_drop(mm_struct_t* mm) {
+    u32 cpu = smp_cpu_id();
+
+    // The owner's reference keeps ttbr_users above zero here
+    u32 flags = spinlock_acquire_irqsave(&asid_lock);
+    bool local = cpu_mm[cpu] == mm;
+    if (local) {
+        cpu_mm[cpu] = NULL;
+        mm->ttbr_users--;
+    }
+    spinlock_release_irqrestore(&asid_lock, flags);
+
+#ifdef ARM
+    if (local && empty_ttbr0) {
+        asm volatile("msr ttbr0_el1, %0\n"
+                     "isb\n"
+                     :: "r"(empty_ttbr0) : "memory");
+    }
+#else
+    (void)local;
+#endif
+}
+
+bool switch_mm_put(mm_struct_t* mm) {
+    u32 flags = spinlock_acquire_irqsave(&asid_lock);
+    bool last = --mm->ttbr_users == 0;
+    spinlock_release_irqrestore(&asid_lock, flags);
+
+    return last;
+}
+
+void tlb_flush_mm_page(mm_struct_t* mm, uintptr_t addr) {
+#ifdef ARM
+    u64 asid = mm->context_id & ASID_MASK;
+
+    asm volatile("dsb ishst\n"
+                 "tlbi vale1is, %0\n"
+                 "dsb ish\n"
+                 "isb\n"
+                 :: "r"((asid << TTBR_ASID_SHIFT) | (addr >> 12)) : "memory");
+#endif
+}
+
+// One barrier pair for the whole range instead of one per page
+void tlb_flush_mm_range(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+#ifdef ARM
+    u64 asid = (mm->context_id & ASID_MASK) << TTBR_ASID_SHIFT;
+
+    asm volatile("dsb ishst" ::: "memory");
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE)
+        asm volatile("tlbi vale1is, %0" :: "r"(asid | (addr >> 12)) : "memory");
+    asm volatile("dsb ish\n"
+                 "isb\n"
+                 ::: "memory");
+#endif
+}
+
+void tlb_flush_mm(mm_struct_t* mm) {
+#ifdef ARM
+    u64 asid = mm->context_id & ASID_MASK;
+
+    asm volatile("dsb ishst\n"
+                 "tlbi aside1is, %0\n"
+                 "dsb ish\n"
+                 "isb\n"
+                 :: "r"(asid << TTBR_ASID_SHIFT) : "memory");
+#endif
+}
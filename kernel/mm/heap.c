@@ -2,31 +2,46 @@
 #include <string.h>
 #include <kio.h>
 #include <spinlock.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <vmalloc.h>
+#include <sched.h>
 
-#define PAGE_SIZE       4096
 #define NUM_CACHE_SIZES (sizeof(slab_sizes) / sizeof(size_t))
 #define PAGE_MASK       (~(PAGE_SIZE - 1))
 #define HEAP_ALIGN      8
 #define SLAB_MAGIC 0x51AB51AB
+#define MAG_ROUNDS      14      // Objects per magazine, keeps a magazine at 128 bytes
+#define DEPOT_MAX_FULL  8       // Full magazines a cache may park before they go back to the slabs
 
 // Size classes for slab caches
 static const size_t slab_sizes[] = {
     16, 32, 64, 128, 256, 512, 1024, 2048
 };
 
-typedef enum {
-    PAGE_TYPE_FREE = 0,
-    PAGE_TYPE_SLAB,
-    PAGE_TYPE_LARGE,
-} page_type_t;
-
-typedef struct {
-    u8 type;
-    u16 count;
-} page_info_t;
+// Heap pages are described by their PMM page_t. PG_HEAP_FREE, PG_SLAB or PG_KMALLOC
+// says who owns them, order holds the run length on the first page (and on the
+// last one of a free run), next/prev link the free runs.
+#define RUN_NONE        ((u32)-1)
+#define RUN_BINS        32      // Bin b holds free runs of [2^b, 2^(b+1)) pages
+#define HEAP_GROW_ORDER 9       // Take 2MB from the PMM when the heap runs dry
+#define HEAP_BOOT_PAGES 2048    // 8MB taken from the PMM by heap_init
 
 struct kmem_cache;
 
+// A stack of free objects owned by one CPU at a time
+typedef struct magazine {
+    struct magazine *next;    // Depot list link
+    u32 rounds;
+    void *objs[MAG_ROUNDS];
+} magazine_t;
+
+// Only ever touched by its own CPU with IRQs off, so it needs no lock
+typedef struct {
+    magazine_t *loaded;
+    magazine_t *prev;
+} __attribute__((aligned(64))) kmem_cpu_cache_t;
+
 // Header stored at the beginning of a slab (4KB page)
 typedef struct slab {
     struct slab *next;
@@ -37,73 +52,184 @@ typedef struct slab {
     u32 magic;
 } slab_t;
 
-typedef struct kmem_cache {
+struct kmem_cache {
     slab_t *slabs_partial;    // Slabs with some free objects
     slab_t *slabs_full;       // Slabs that are completely full
     slab_t *slabs_free;       // Slabs that are completely empty (optional cache)
-    size_t obj_size;          // Size of objects in this cache
-} kmem_cache_t;
+    size_t obj_size;          // Stride of objects in this cache
+    size_t size;              // Size requested by the user
+    size_t align;             // Alignment of every object
+    size_t free_offset;       // Where the free list link lives inside a free object
+    void (*ctor)(void*);      // Runs once per object when its slab is created
+    const char *name;
+    struct kmem_cache *next;  // Named caches, for heap_debug()
+
+    kmem_cpu_cache_t cpu[MAX_CPUS];
+    magazine_t *depot_full;   // Depot, protected by heap_lock
+    magazine_t *depot_empty;
+    u32 depot_full_count;
+};
 
 static spinlock_t heap_lock = 0;
-static uintptr_t heap_start_addr = 0;
-static uintptr_t heap_end_addr = 0;
-static page_info_t *page_metadata = NULL;
-static u32 total_pages = 0;
+static u32 heap_pages = 0;                      // Pages owned by the heap, free or not
 static kmem_cache_t caches[NUM_CACHE_SIZES];
+static kmem_cache_t cache_cache;                // Holds the named cache descriptors
+static kmem_cache_t mag_cache;                  // Holds the magazines
+static kmem_cache_t *named_caches = NULL;
+static u32 free_runs[RUN_BINS];
+static u32 free_runs_map = 0;                   // Bit b set when free_runs[b] is not empty
 
 static inline size_t align_up(size_t n, size_t align) {
     return (n + align - 1) & ~(align - 1);
 }
 
-// Convert a virtual address to the page index in our heap
-static inline u32 virt_to_page_idx(uintptr_t addr) {
-    if (addr < heap_start_addr || addr >= heap_end_addr)
-        return (u32)-1;
-    
-    return (addr - heap_start_addr) / PAGE_SIZE;
+// Page descriptor behind a linear map address, NULL outside of RAM
+static inline page_t* heap_page(uintptr_t addr) {
+    if (addr < PHYS_OFFSET) return NULL;
+    return phys_to_page(addr - PHYS_OFFSET);
+}
+
+static inline u32 heap_page_idx(uintptr_t addr) {
+    page_t *page = heap_page(addr);
+    return page ? (u32)(page - pages) : RUN_NONE;
 }
 
 static inline uintptr_t page_idx_to_virt(u32 idx) {
-    return heap_start_addr + (uintptr_t)idx * PAGE_SIZE;
+    return (uintptr_t)P2V(page_to_phys(&pages[idx]));
 }
 
-// Allocates contiguous pages from the heap region
-static void* alloc_pages_backend(size_t num_pages, page_type_t type) {
-    u32 free_run = 0;
-    u32 start_idx = (u32)-1;
+static inline bool heap_page_free(u32 idx) {
+    return idx < total_frames && (pages[idx].flags & PG_HEAP_FREE);
+}
 
-    for (u32 i = 0; i < total_pages; i++) {
-        if (page_metadata[i].type == PAGE_TYPE_FREE) {
-            if (free_run == 0) start_idx = i;
+static inline u32 run_bin(u32 pages) {
+    return 31 - __builtin_clz(pages);
+}
 
-            free_run++;
-            if (free_run == num_pages) {
-                for (u32 j = 0; j < num_pages; j++) {
-                    page_metadata[start_idx + j].type = type;
-                    page_metadata[start_idx + j].count = (j == 0) ? num_pages : 0;
-                }
+static void run_insert(u32 idx, u32 count) {
+    u32 bin = run_bin(count);
 
-                return (void*)page_idx_to_virt(start_idx);
-            }
-        } else free_run = 0;
+    pages[idx].order = count;
+    pages[idx + count - 1].order = count;
+    pages[idx].prev = RUN_NONE;
+    pages[idx].next = free_runs[bin];
+    if (free_runs[bin] != RUN_NONE)
+        pages[free_runs[bin]].prev = idx;
+    
+    free_runs[bin] = idx;
+    free_runs_map |= 1U << bin;
+}
+
+static void run_remove(u32 idx) {
+    u32 bin = run_bin(pages[idx].order);
+    u32 next = pages[idx].next;
+    u32 prev = pages[idx].prev;
+
+    if (prev != RUN_NONE) pages[prev].next = next;
+    else free_runs[bin] = next;
+
+    if (next != RUN_NONE) pages[next].prev = prev;
+    if (free_runs[bin] == RUN_NONE) free_runs_map &= ~(1U << bin);
+}
+
+// Returns [idx, idx + count) to the free runs, merging with free neighbours
+static void run_free(u32 idx, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+        pages[idx + i].flags = PG_HEAP_FREE;
+        pages[idx + i].order = 0;
     }
 
-    return NULL;
+    u32 end = idx + count;
+    if (heap_page_free(end)) {
+        u32 next_count = pages[end].order;
+        run_remove(end);
+        pages[end].order = 0;
+        count += next_count;
+    }
+
+    if (idx > 0 && heap_page_free(idx - 1)) {
+        u32 prev_count = pages[idx - 1].order;
+        run_remove(idx - prev_count);
+        pages[idx - 1].order = 0;
+        idx -= prev_count;
+        count += prev_count;
+    }
+
+    run_insert(idx, count);
 }
 
-static void free_pages_backend(void* ptr) {
-    u32 idx = virt_to_page_idx((uintptr_t)ptr);
-    if (idx >= total_pages) return;
+// Finds a free run of at least num_pages. Bins above the request always fit,
+// so the request's own bin is only searched when nothing bigger is left.
+static u32 run_find(u32 num_pages) {
+    u32 bin = run_bin(num_pages);
+    u32 fit_bin = (num_pages & (num_pages - 1)) ? bin + 1 : bin;
 
-    u32 count = page_metadata[idx].count;
-    if (count == 0) return;
+    u32 mask = fit_bin < RUN_BINS ? free_runs_map & ~((1U << fit_bin) - 1) : 0;
+    if (mask) return free_runs[__builtin_ctz(mask)];
 
-    for (u32 i = 0; i < count; i++) {
-        if (idx + i < total_pages) {
-            page_metadata[idx + i].type = PAGE_TYPE_FREE;
-            page_metadata[idx + i].count = 0;
+    if (fit_bin == bin) return RUN_NONE;
+
+    for (u32 idx = free_runs[bin]; idx != RUN_NONE; idx = pages[idx].next)
+        if (pages[idx].order >= num_pages) return idx;
+
+    return RUN_NONE;
+}
+
+// Pulls a physically contiguous block from the PMM into the free runs.
+// It merges with any heap run it happens to touch.
+static bool heap_grow(size_t num_pages) {
+    u32 min_order = 0;
+    while ((1UL << min_order) < num_pages) min_order++;
+    if (min_order > PMM_MAX_ORDER) return false;
+
+    u32 order = min_order > HEAP_GROW_ORDER ? min_order : HEAP_GROW_ORDER;
+    for (;; order--) {
+        uintptr_t phys = pmm_alloc_pages(order);
+        if (phys) {
+            run_free(phys_to_page(phys) - pages, 1U << order);
+            heap_pages += 1U << order;
+            return true;
         }
+
+        if (order == min_order) return false;
+    }
+}
+
+// Allocates contiguous pages from the heap, growing it if needed
+static void* alloc_pages_backend(size_t num_pages, u32 type) {
+    if (num_pages == 0) return NULL;
+
+    u32 idx = run_find(num_pages);
+    if (idx == RUN_NONE) {
+        if (!heap_grow(num_pages)) return NULL;
+        idx = run_find(num_pages);
+        if (idx == RUN_NONE) return NULL;
+    }
+
+    u32 count = pages[idx].order;
+    run_remove(idx);
+    pages[idx + count - 1].order = 0;
+
+    // Give the tail back
+    if (count > num_pages)
+        run_insert(idx + num_pages, count - num_pages);
+
+    for (u32 j = 0; j < num_pages; j++) {
+        pages[idx + j].flags = type;
+        pages[idx + j].order = (j == 0) ? num_pages : 0;
     }
+
+    return (void*)page_idx_to_virt(idx);
+}
+
+static void free_pages_backend(void* ptr) {
+    u32 idx = heap_page_idx((uintptr_t)ptr);
+    if (idx == RUN_NONE) return;
+
+    u32 count = pages[idx].order;
+    if (count == 0 || !(pages[idx].flags & (PG_SLAB | PG_KMALLOC))) return;
+
+    run_free(idx, count);
 }
 
 static void slab_init_page(slab_t *slab, kmem_cache_t *cache) {
@@ -115,7 +241,7 @@ static void slab_init_page(slab_t *slab, kmem_cache_t *cache) {
 
     uintptr_t base = (uintptr_t)slab;
     uintptr_t start = base + sizeof(slab_t);
-    start = align_up(start, HEAP_ALIGN);
+    start = align_up(start, cache->align);
 
     size_t available = PAGE_SIZE - (start - base);
     size_t max_objs = available / cache->obj_size;
@@ -123,13 +249,13 @@ static void slab_init_page(slab_t *slab, kmem_cache_t *cache) {
     slab->free_list = (void*)start;
     uintptr_t curr = start;
     
-    for (size_t i = 0; i < max_objs - 1; i++) {
-        void **next_ptr = (void**)curr;
-        *next_ptr = (void*)(curr + cache->obj_size);
+    for (size_t i = 0; i < max_objs; i++) {
+        if (cache->ctor) cache->ctor((void*)curr);
+
+        void **next_ptr = (void**)(curr + cache->free_offset);
+        *next_ptr = (i == max_objs - 1) ? NULL : (void*)(curr + cache->obj_size);
         curr += cache->obj_size;
     }
-
-    *((void**)curr) = NULL;
 }
 
 static void* cache_alloc(kmem_cache_t *c) {
@@ -141,7 +267,7 @@ static void* cache_alloc(kmem_cache_t *c) {
             c->slabs_free = slab->next;
             if (c->slabs_free) c->slabs_free->prev = NULL;
         } else {
-            slab = (slab_t*)alloc_pages_backend(1, PAGE_TYPE_SLAB);
+            slab = (slab_t*)alloc_pages_backend(1, PG_SLAB);
             if (!slab) return NULL;
             slab_init_page(slab, c);
         }
@@ -153,7 +279,7 @@ static void* cache_alloc(kmem_cache_t *c) {
     }
 
     void *obj = slab->free_list;
-    slab->free_list = *((void**)obj);
+    slab->free_list = *((void**)((uintptr_t)obj + c->free_offset));
     slab->in_use++;
 
     if (!slab->free_list) {
@@ -188,7 +314,7 @@ static void cache_free(kmem_cache_t *c, void *ptr) {
     bool was_full = (slab->free_list == NULL);
 
     // Add object back to free list
-    *((void**)ptr) = slab->free_list;
+    *((void**)((uintptr_t)ptr + c->free_offset)) = slab->free_list;
     slab->free_list = ptr;
     slab->in_use--;
 
@@ -231,95 +357,426 @@ static void cache_free(kmem_cache_t *c, void *ptr) {
     }
 }
 
-void heap_init(uintptr_t start, size_t size) {
-    uintptr_t aligned_start = (start + PAGE_SIZE - 1) & PAGE_MASK;
-    size_t diff = aligned_start - start;
-    if (size < diff) return;
-    size -= diff;
+// Takes a full magazine from the depot for an empty CPU. Called with heap_lock held.
+static bool depot_swap_full(kmem_cache_t *c, kmem_cpu_cache_t *cc) {
+    magazine_t *full = c->depot_full;
+    if (!full) return false;
+
+    c->depot_full = full->next;
+    c->depot_full_count--;
+
+    if (cc->prev) {
+        cc->prev->next = c->depot_empty;
+        c->depot_empty = cc->prev;
+    }
+
+    cc->prev = cc->loaded;
+    cc->loaded = full;
+    return true;
+}
+
+// Parks a full magazine and hands the CPU an empty one. Called with heap_lock held.
+static bool depot_swap_empty(kmem_cache_t *c, kmem_cpu_cache_t *cc) {
+    magazine_t *empty = c->depot_empty;
+    if (empty) c->depot_empty = empty->next;
+
+    else {
+        empty = (magazine_t*)cache_alloc(&mag_cache);
+        if (!empty) return false;
+    }
+
+    empty->rounds = 0;
+
+    if (cc->prev) {
+        magazine_t *full = cc->prev;
+
+        // Too much parked already, give the objects back to their slabs
+        if (c->depot_full_count >= DEPOT_MAX_FULL) {
+            while (full->rounds)
+                cache_free(c, full->objs[--full->rounds]);
+
+            full->next = c->depot_empty;
+            c->depot_empty = full;
+        } else {
+            full->next = c->depot_full;
+            c->depot_full = full;
+            c->depot_full_count++;
+        }
+    }
+
+    cc->prev = cc->loaded;
+    cc->loaded = empty;
+    return true;
+}
+
+// Lock free unless both CPU magazines are empty
+static void* magazine_alloc(kmem_cache_t *c) {
+    u32 cpu = smp_cpu_id();
+    if (cpu >= MAX_CPUS) {
+        u32 flags = spinlock_acquire_irqsave(&heap_lock);
+        void *obj = cache_alloc(c);
+        spinlock_release_irqrestore(&heap_lock, flags);
+        return obj;
+    }
+
+    u32 irq = local_irq_save();
+    kmem_cpu_cache_t *cc = &c->cpu[cpu];
+
+    if (cc->loaded && cc->loaded->rounds) {
+        void *obj = cc->loaded->objs[--cc->loaded->rounds];
+        local_irq_restore(irq);
+        return obj;
+    }
+
+    if (cc->prev && cc->prev->rounds) {
+        magazine_t *tmp = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = tmp;
+
+        void *obj = cc->loaded->objs[--cc->loaded->rounds];
+        local_irq_restore(irq);
+        return obj;
+    }
+
+    spinlock_acquire(&heap_lock);
+
+    void *obj;
+    if (depot_swap_full(c, cc))
+        obj = cc->loaded->objs[--cc->loaded->rounds];
     
-    total_pages = size / PAGE_SIZE;
-    if (total_pages == 0) return;
+    else obj = cache_alloc(c);
 
-    heap_start_addr = aligned_start;
-    heap_end_addr = heap_start_addr + (total_pages * PAGE_SIZE);
+    spinlock_release(&heap_lock);
+    local_irq_restore(irq);
 
-    // Place metadata at the start of the heap
-    size_t meta_size = total_pages * sizeof(page_info_t);
-    size_t meta_pages = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    return obj;
+}
+
+// Lock free unless both CPU magazines are full
+static void magazine_free(kmem_cache_t *c, void *ptr) {
+    u32 cpu = smp_cpu_id();
+    if (cpu >= MAX_CPUS) {
+        u32 flags = spinlock_acquire_irqsave(&heap_lock);
+        cache_free(c, ptr);
+        spinlock_release_irqrestore(&heap_lock, flags);
+        return;
+    }
+
+    u32 irq = local_irq_save();
+    kmem_cpu_cache_t *cc = &c->cpu[cpu];
 
-    if (meta_pages >= total_pages) {
-        kprintf("[HEAP] Error: Heap too small for metadata\n");
+    if (cc->loaded && cc->loaded->rounds < MAG_ROUNDS) {
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        local_irq_restore(irq);
         return;
     }
 
-    page_metadata = (page_info_t*)heap_start_addr;
-    memset(page_metadata, 0, meta_size);
+    if (cc->prev && cc->prev->rounds < MAG_ROUNDS) {
+        magazine_t *tmp = cc->loaded;
+        cc->loaded = cc->prev;
+        cc->prev = tmp;
 
-    // Reserve metadata pages
-    for (size_t i = 0; i < meta_pages; i++) {
-        page_metadata[i].type = PAGE_TYPE_LARGE; // Reserved
-        page_metadata[i].count = 1;
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+        local_irq_restore(irq);
+        return;
     }
 
+    spinlock_acquire(&heap_lock);
+
+    if (depot_swap_empty(c, cc))
+        cc->loaded->objs[cc->loaded->rounds++] = ptr;
+    
+    else cache_free(c, ptr);
+
+    spinlock_release(&heap_lock);
+    local_irq_restore(irq);
+}
+
+// Checks that ptr is the start of a live slab object of c
+static bool slab_owns(kmem_cache_t *c, void *ptr) {
+    page_t *page = heap_page((uintptr_t)ptr);
+    if (!page || !(page->flags & PG_SLAB)) return false;
+
+    slab_t *slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
+    return slab->magic == SLAB_MAGIC && slab->cache == c;
+}
+
+// Seeds the run allocator with memory from the PMM, further memory is grown on demand
+void heap_init() {
+    for (int i = 0; i < RUN_BINS; i++)
+        free_runs[i] = RUN_NONE;
+    
+    free_runs_map = 0;
+
+    while (heap_pages < HEAP_BOOT_PAGES && heap_grow(1U << PMM_MAX_ORDER));
+
     // Initialize Caches
     for (int i = 0; i < NUM_CACHE_SIZES; i++) {
+        memset(&caches[i], 0, sizeof(kmem_cache_t));
         caches[i].obj_size = slab_sizes[i];
-        caches[i].slabs_full = NULL;
-        caches[i].slabs_partial = NULL;
-        caches[i].slabs_free = NULL;
+        caches[i].size = slab_sizes[i];
+        caches[i].align = HEAP_ALIGN;
     }
 
-    kprintf("[HEAP] Slab Allocator Initialized: %d MB (%d pages)\n", size/1024/1024, total_pages);
+    memset(&cache_cache, 0, sizeof(kmem_cache_t));
+    cache_cache.obj_size = align_up(sizeof(kmem_cache_t), CACHE_LINE_SIZE);
+    cache_cache.size = sizeof(kmem_cache_t);
+    cache_cache.align = CACHE_LINE_SIZE;
+    cache_cache.name = "kmem_cache";
+
+    memset(&mag_cache, 0, sizeof(kmem_cache_t));
+    mag_cache.obj_size = align_up(sizeof(magazine_t), HEAP_ALIGN);
+    mag_cache.size = sizeof(magazine_t);
+    mag_cache.align = HEAP_ALIGN;
+    mag_cache.name = "magazine";
+
+    kprintf("[HEAP] Slab Allocator Initialized: %d MB (%d pages), grows from the PMM\n",
+            heap_pages * PAGE_SIZE / 1024 / 1024, heap_pages);
 }
 
-void* kmalloc(size_t size) {
-    if (size == 0) return NULL;
+#ifdef KMALLOC_PROFILE
+// Live allocations are remembered in an open addressing table, so kfree can
+// charge the bytes back to the site that allocated them
+#define PROF_LIVE       16384   // Power of 2
 
-    u32 flags = spinlock_acquire_irqsave(&heap_lock);
+typedef struct {
+    uintptr_t ptr;
+    u32 size;
+    u32 site;
+} prof_live_t;
+
+static kmalloc_site_t prof_sites[PROF_SITES];
+static prof_live_t prof_live[PROF_LIVE];
+static u32 prof_live_count = 0;                 // Kept under 3/4 of PROF_LIVE so probes end
+static spinlock_t prof_lock = 0;
+static u64 prof_untracked = 0;
+
+static inline u32 prof_hash(uintptr_t key, u32 size) {
+    return (u32)((key >> 3) * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+}
+
+// Finds or claims the slot of a call site, PROF_SITES when the table is full
+static u32 prof_site_idx(uintptr_t site) {
+    u32 i = prof_hash(site, PROF_SITES);
+
+    for (u32 n = 0; n < PROF_SITES; n++, i = (i + 1) & (PROF_SITES - 1)) {
+        if (prof_sites[i].site == site) return i;
+        if (prof_sites[i].site == 0) {
+            prof_sites[i].site = site;
+            return i;
+        }
+    }
+
+    return PROF_SITES;
+}
+
+static void prof_alloc(void *ptr, size_t size, void *caller) {
+    if (!ptr) return;
+
+    u32 flags = spinlock_acquire_irqsave(&prof_lock);
+
+    u32 site = prof_site_idx((uintptr_t)caller);
+
+    if (site == PROF_SITES || prof_live_count >= PROF_LIVE / 4 * 3) prof_untracked++;
+
+    else {
+        u32 i = prof_hash((uintptr_t)ptr, PROF_LIVE);
+        while (prof_live[i].ptr)
+            i = (i + 1) & (PROF_LIVE - 1);
+
+        prof_live_count++;
+        prof_live[i].ptr = (uintptr_t)ptr;
+        prof_live[i].size = size;
+        prof_live[i].site = site;
+
+        kmalloc_site_t *s = &prof_sites[site];
+        s->allocs++;
+        s->live_bytes += size;
+        if (s->live_bytes > s->peak_bytes) s->peak_bytes = s->live_bytes;
+    }
+
+    spinlock_release_irqrestore(&prof_lock, flags);
+}
+
+static void prof_free(void *ptr) {
+    if (!ptr) return;
+
+    u32 flags = spinlock_acquire_irqsave(&prof_lock);
+
+    u32 i = prof_hash((uintptr_t)ptr, PROF_LIVE);
+    for (; prof_live[i].ptr; i = (i + 1) & (PROF_LIVE - 1)) {
+        if (prof_live[i].ptr != (uintptr_t)ptr) continue;
+
+        prof_live_count--;
+
+        kmalloc_site_t *s = &prof_sites[prof_live[i].site];
+        s->frees++;
+        s->live_bytes -= prof_live[i].size;
+
+        // Backward shift deletion keeps every probe chain unbroken
+        u32 j = i;
+        for (;;) {
+            j = (j + 1) & (PROF_LIVE - 1);
+            if (!prof_live[j].ptr) break;
 
-    void *ptr = NULL;
+            u32 k = prof_hash(prof_live[j].ptr, PROF_LIVE);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+
+            prof_live[i] = prof_live[j];
+            i = j;
+        }
+
+        prof_live[i].ptr = 0;
+        break;
+    }
+
+    spinlock_release_irqrestore(&prof_lock, flags);
+}
+
+u32 kmalloc_profile_read(kmalloc_site_t *out, u32 max) {
+    u32 count = 0;
+    u32 flags = spinlock_acquire_irqsave(&prof_lock);
+
+    for (u32 i = 0; i < PROF_SITES; i++) {
+        if (!prof_sites[i].site) continue;
+        if (out && count < max) out[count] = prof_sites[i];
+        count++;
+    }
+
+    spinlock_release_irqrestore(&prof_lock, flags);
+    return count;
+}
+#else
+#define prof_alloc(ptr, size, caller)
+#define prof_free(ptr)
+#endif
+
+static void* kmalloc_raw(size_t size) {
+    if (size == 0) return NULL;
 
     if (size <= 2048) {
         for (int i = 0; i < NUM_CACHE_SIZES; i++) {
-            if (size <= caches[i].obj_size) {
-                ptr = cache_alloc(&caches[i]);
-                break;
-            }
+            if (size <= caches[i].obj_size)
+                return magazine_alloc(&caches[i]);
         }
+    }
+
+    size_t pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Past the PMM's largest block nothing physically contiguous is left to grow from
+    if (pages_needed > (1UL << PMM_MAX_ORDER))
+        return vmalloc(size);
+
+    u32 flags = spinlock_acquire_irqsave(&heap_lock);
+    void *ptr = alloc_pages_backend(pages_needed, PG_KMALLOC);
+
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+static void kfree_raw(void* ptr) {
+    if (!ptr) return;
+
+    if (is_vmalloc_addr(ptr)) {
+        vfree(ptr);
+        return;
+    }
+
+    page_t *page = heap_page((uintptr_t)ptr);
+
+    // A live object pins its slab page, so the slab header is stable without the lock
+    if (page && (page->flags & PG_SLAB)) {
+        slab_t *slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
+        if (slab->magic == SLAB_MAGIC && slab->cache)
+            magazine_free(slab->cache, ptr);
+
+        else kprintf("[HEAP] Corruption: Invalid slab magic at %p\n", slab);
+
+        return;
+    }
+
+    u32 flags = spinlock_acquire_irqsave(&heap_lock);
+
+    if (page && (page->flags & PG_KMALLOC) && page->order) {
+        free_pages_backend(ptr);
     } else {
-        size_t pages_needed = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        ptr = alloc_pages_backend(pages_needed, PAGE_TYPE_LARGE);
+        kprintf("[HEAP] Warning: Double free or invalid free at %p\n", ptr);
     }
 
     spinlock_release_irqrestore(&heap_lock, flags);
+}
+
+void* kmalloc(size_t size) {
+    void *ptr = kmalloc_raw(size);
+    prof_alloc(ptr, size, __builtin_return_address(0));
     return ptr;
 }
 
 void kfree(void* ptr) {
-    if (!ptr) return;
+    prof_free(ptr);
+    kfree_raw(ptr);
+}
+
+kmem_cache_t* kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (size == 0) return NULL;
+    if (align < HEAP_ALIGN) align = HEAP_ALIGN;
+
+    if (align & (align - 1)) {
+        kprintf("[HEAP] kmem_cache_create(%s): alignment %d is not a power of 2\n", name, align);
+        return NULL;
+    }
+
+    // A constructed object has to survive on the free list, so its link goes after it
+    size_t free_offset = ctor ? align_up(size, sizeof(void*)) : 0;
+    size_t obj_size = align_up(ctor ? free_offset + sizeof(void*) : size, align);
+    if (obj_size < sizeof(void*)) obj_size = align_up(sizeof(void*), align);
+
+    if (align_up(sizeof(slab_t), align) + obj_size > PAGE_SIZE) {
+        kprintf("[HEAP] kmem_cache_create(%s): object of %d bytes does not fit a slab\n", name, size);
+        return NULL;
+    }
 
     u32 flags = spinlock_acquire_irqsave(&heap_lock);
 
-    u32 idx = virt_to_page_idx((uintptr_t)ptr);
-    if (idx < total_pages) {
-        if (page_metadata[idx].type == PAGE_TYPE_SLAB) {
-            slab_t *slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
-            if (slab->cache) {
-                cache_free(slab->cache, ptr);
-            }
-        } else if (page_metadata[idx].type == PAGE_TYPE_LARGE) {
-            free_pages_backend(ptr);
-        } else {
-            kprintf("[HEAP] Warning: Double free or invalid free at %p\n", ptr);
-        }
+    kmem_cache_t *c = cache_alloc(&cache_cache);
+    if (c) {
+        memset(c, 0, sizeof(kmem_cache_t));
+        c->obj_size = obj_size;
+        c->size = size;
+        c->align = align;
+        c->free_offset = free_offset;
+        c->ctor = ctor;
+        c->name = name;
+
+        c->next = named_caches;
+        named_caches = c;
     }
 
     spinlock_release_irqrestore(&heap_lock, flags);
+    return c;
+}
+
+void* kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache) return NULL;
+
+    return magazine_alloc(cache);
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *ptr) {
+    if (!ptr) return;
+
+    if (!slab_owns(cache, ptr)) {
+        kprintf("[HEAP] Warning: %p does not belong to cache %s\n", ptr, cache->name);
+        return;
+    }
+
+    magazine_free(cache, ptr);
 }
 
 void* kcalloc(size_t num, size_t size) {
     size_t total = num * size;
-    void* ptr = kmalloc(total);
+    void* ptr = kmalloc_raw(total);
+    prof_alloc(ptr, total, __builtin_return_address(0));
     if (ptr) {
         memset(ptr, 0, total);
     }
@@ -327,31 +784,37 @@ void* kcalloc(size_t num, size_t size) {
 }
 
 void* krealloc(void* ptr, size_t new_size) {
-    if (!ptr) return kmalloc(new_size);
+    if (!ptr) {
+        ptr = kmalloc_raw(new_size);
+        prof_alloc(ptr, new_size, __builtin_return_address(0));
+        return ptr;
+    }
+
     if (new_size == 0) {
         kfree(ptr);
         return NULL;
     }
 
     // Determine old size
-    size_t old_size = 0;
+    size_t old_size = is_vmalloc_addr(ptr) ? vmalloc_size(ptr) : 0;
     
     u32 flags = spinlock_acquire_irqsave(&heap_lock);
-    u32 idx = virt_to_page_idx((uintptr_t)ptr);
+    page_t *page = heap_page((uintptr_t)ptr);
     
-    if (idx < total_pages) {
-        if (page_metadata[idx].type == PAGE_TYPE_SLAB) {
+    if (page) {
+        if (page->flags & PG_SLAB) {
             slab_t *slab = (slab_t*)((uintptr_t)ptr & PAGE_MASK);
-            if (slab->cache) old_size = slab->cache->obj_size;
-        } else if (page_metadata[idx].type == PAGE_TYPE_LARGE) {
-            old_size = page_metadata[idx].count * PAGE_SIZE;
+            if (slab->cache) old_size = slab->cache->size;
+        } else if (page->flags & PG_KMALLOC) {
+            old_size = page->order * PAGE_SIZE;
         }
     }
     spinlock_release_irqrestore(&heap_lock, flags);
 
     if (old_size >= new_size) return ptr;
 
-    void* new_ptr = kmalloc(new_size);
+    void* new_ptr = kmalloc_raw(new_size);
+    prof_alloc(new_ptr, new_size, __builtin_return_address(0));
     if (new_ptr) {
         memcpy(new_ptr, ptr, old_size);
         kfree(ptr);
@@ -363,6 +826,7 @@ void heap_debug() {
     u32 flags = spinlock_acquire_irqsave(&heap_lock);
 
     kprintf("--- Slab Allocator Status ---\n");
+    kprintf("Heap: %d KB taken from the PMM\n", heap_pages * PAGE_SIZE / 1024);
     for (int i = 0; i < NUM_CACHE_SIZES; i++) {
         kmem_cache_t *c = &caches[i];
         if (c->slabs_partial || c->slabs_full) {
@@ -373,5 +837,28 @@ void heap_debug() {
         }
     }
 
+    for (kmem_cache_t *c = named_caches; c; c = c->next) {
+        u32 slabs = 0, objs = 0;
+        for (slab_t *s = c->slabs_partial; s; s = s->next) { slabs++; objs += s->in_use; }
+        for (slab_t *s = c->slabs_full; s; s = s->next) { slabs++; objs += s->in_use; }
+
+        kprintf("Cache %s (%d bytes): %d objects in %d slabs, %d full magazines in depot\n",
+            c->name, c->obj_size, objs, slabs, c->depot_full_count);
+    }
+
     spinlock_release_irqrestore(&heap_lock, flags);
+
+#ifdef KMALLOC_PROFILE
+    // The site table belongs to prof_lock, not heap_lock
+    flags = spinlock_acquire_irqsave(&prof_lock);
+
+    kprintf("kmalloc sites (%d untracked allocations):\n", prof_untracked);
+    for (u32 i = 0; i < PROF_SITES; i++) {
+        kmalloc_site_t *s = &prof_sites[i];
+        if (s->site && s->live_bytes)
+            kprintf("  %p: %d bytes live, %d peak, %d allocs\n", s->site, s->live_bytes, s->peak_bytes, s->allocs);
+    }
+
+    spinlock_release_irqrestore(&prof_lock, flags);
+#endif
 }
\ No newline at end of file
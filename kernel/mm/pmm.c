@@ -2,21 +2,41 @@
 #include <string.h>
 #include <kio.h>
 #include <spinlock.h>
+#include <sched.h>
 
-//TODO: Implement a buddy allocator
+// Binary buddy allocator. Free blocks of 2^order frames are kept in one
+// doubly linked list per order, threaded through the pages[] array by index.
+// Single frames go through small per-CPU caches first, which are refilled
+// from and drained to the buddy lists in batches under pmm_lock.
 
-u32 *frame_stack = NULL;
-static u32 stack_top = 0;      // Points to the next free slot (or count of free frames)
-static u32 stack_capacity = 0;
+#define PCP_BATCH       32      // Frames moved per refill/drain
+#define PCP_HIGH        128     // Cache size that triggers a drain
+#define ZERO_POOL_SIZE  256     // Frames kept pre-zeroed by idle CPUs (1MB)
+
+typedef struct {
+    u32 count;
+    u32 frames[PCP_HIGH];
+} __attribute__((aligned(64))) pmm_pcp_t;
+
+page_t *pages = NULL;
+static u32 free_lists[PMM_MAX_ORDER + 1];
+static u32 free_frames = 0;
 static u32 used_frames = 0;
 static spinlock_t pmm_lock = 0;
+static pmm_pcp_t pcp[MAX_CPUS];
+
+// Frames zeroed ahead of time, they stay allocated (refcount 1) while pooled
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static u32 zero_count = 0;
+static spinlock_t zero_lock = 0;
+
+// Offset of the linear map, 0 until paging is on
+static uintptr_t pmm_virt_offset = 0;
 
 u64 phy_ram_size = 0;
 u64 phy_ram_end = 0;
 u32 total_frames = 0;
 
-u8* ref_counts = NULL;
-
 static inline u32 phys_to_index(uintptr_t addr) {
     if (addr < PHY_RAM_BASE || addr >= phy_ram_end) return (u32)-1;
     return (addr - PHY_RAM_BASE) >> PAGE_SHIFT;
@@ -26,13 +46,205 @@ static inline uintptr_t index_to_phys(u32 idx) {
     return PHY_RAM_BASE + ((uintptr_t)idx << PAGE_SHIFT);
 }
 
-void pmm_inc_ref(uintptr_t phys) {
+static inline void free_list_push(u32 order, u32 idx) {
+    pages[idx].flags = PG_BUDDY;
+    pages[idx].order = order;
+    pages[idx].prev = PMM_NO_FRAME;
+    pages[idx].next = free_lists[order];
+
+    if (free_lists[order] != PMM_NO_FRAME)
+        pages[free_lists[order]].prev = idx;
+
+    free_lists[order] = idx;
+    free_frames += 1U << order;
+}
+
+static inline void free_list_remove(u32 order, u32 idx) {
+    if (pages[idx].prev != PMM_NO_FRAME)
+        pages[pages[idx].prev].next = pages[idx].next;
+    else free_lists[order] = pages[idx].next;
+
+    if (pages[idx].next != PMM_NO_FRAME)
+        pages[pages[idx].next].prev = pages[idx].prev;
+
+    pages[idx].flags = 0;
+    pages[idx].next = PMM_NO_FRAME;
+    pages[idx].prev = PMM_NO_FRAME;
+    free_frames -= 1U << order;
+}
+
+// Takes a block of the requested order, splitting a larger one if needed
+static u32 buddy_alloc(u32 order) {
+    u32 current = order;
+    while (current <= PMM_MAX_ORDER && free_lists[current] == PMM_NO_FRAME)
+        current++;
+
+    if (current > PMM_MAX_ORDER) return PMM_NO_FRAME;
+
+    u32 idx = free_lists[current];
+    free_list_remove(current, idx);
+
+    // Give the upper halves back until the block has the right size
+    while (current > order) {
+        current--;
+        free_list_push(current, idx + (1U << current));
+    }
+
+    return idx;
+}
+
+// Returns a block to the free lists, merging it with its free buddies
+static void buddy_free(u32 idx, u32 order) {
+    while (order < PMM_MAX_ORDER) {
+        u32 buddy = idx ^ (1U << order);
+
+        if (buddy + (1U << order) > total_frames) break;
+        if (!(pages[buddy].flags & PG_BUDDY) || pages[buddy].order != order) break;
+
+        free_list_remove(order, buddy);
+        idx &= ~(1U << order);
+        order++;
+    }
+
+    free_list_push(order, idx);
+}
+
+// Adds [start, end) to the free lists as the largest aligned blocks possible
+static void buddy_free_range(u32 start, u32 end) {
+    while (start < end) {
+        u32 order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((1U << order) - 1)) || start + (1U << order) > end))
+            order--;
+
+        free_list_push(order, start);
+        start += 1U << order;
+    }
+}
+
+// Finds the free block containing idx, returns its head or PMM_NO_FRAME
+static u32 buddy_find_block(u32 idx, u32 *order_out) {
+    for (u32 order = 0; order <= PMM_MAX_ORDER; order++) {
+        u32 head = idx & ~((1U << order) - 1);
+
+        if ((pages[head].flags & PG_BUDDY) && pages[head].order == order) {
+            *order_out = order;
+            return head;
+        }
+    }
+
+    return PMM_NO_FRAME;
+}
+
+// Takes [start, end) out of the free lists a whole block at a time, the parts
+// of a block that stick out of the range go straight back. Returns frames taken.
+static u32 buddy_reserve_range(u32 start, u32 end) {
+    u32 taken = 0;
+    u32 idx = start;
+
+    while (idx < end) {
+        u32 order;
+        u32 head = buddy_find_block(idx, &order);
+
+        // Already in use
+        if (head == PMM_NO_FRAME) {
+            idx++;
+            continue;
+        }
+
+        u32 block_end = head + (1U << order);
+        u32 cut_start = head > start ? head : start;
+        u32 cut_end = block_end < end ? block_end : end;
+
+        free_list_remove(order, head);
+        buddy_free_range(head, cut_start);
+        buddy_free_range(cut_end, block_end);
+
+        for (u32 i = cut_start; i < cut_end; i++) {
+            pages[i].refcount = 1;
+            pages[i].flags = PG_RESERVED;
+        }
+
+        taken += cut_end - cut_start;
+        idx = cut_end;
+    }
+
+    return taken;
+}
+
+page_t *phys_to_page(uintptr_t phys) {
     u32 idx = phys_to_index(phys);
-    if (idx != (u32)-1 && ref_counts) {
-        u32 flags = spinlock_acquire_irqsave(&pmm_lock);
-        if (ref_counts[idx] < 255) ref_counts[idx]++;
-        spinlock_release_irqrestore(&pmm_lock, flags);
+    if (idx == (u32)-1 || !pages) return NULL;
+
+    return &pages[idx];
+}
+
+uintptr_t page_to_phys(page_t *page) {
+    return index_to_phys(page - pages);
+}
+
+void pmm_inc_ref(uintptr_t phys) {
+    page_t *page = phys_to_page(phys);
+    if (page) __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+u32 pmm_get_ref(uintptr_t phys) {
+    page_t *page = phys_to_page(phys);
+    return page ? __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Drops one reference, returns true if it was the last one
+static bool pmm_dec_ref(u32 idx) {
+    u32 old = __atomic_load_n(&pages[idx].refcount, __ATOMIC_RELAXED);
+    while (old > 0) {
+        if (__atomic_compare_exchange_n(&pages[idx].refcount, &old, old - 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            if (old != 1) return false;
+
+            // Last reference: the descriptor is ours again, reset it for the next owner
+            pages[idx].flags = 0;
+            pages[idx].mapcount = 0;
+            pages[idx].owner = NULL;
+            return true;
+        }
     }
+
+    kprintf("[ [CPMM [W] Error: Double free of frame 0x%llx\n", index_to_phys(idx));
+    return false;
+}
+
+// Moves a batch of order 0 frames from the buddy lists into a CPU cache
+static void pcp_refill(pmm_pcp_t *cache) {
+    u32 flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    while (cache->count < PCP_BATCH) {
+        u32 idx = free_lists[0];
+        if (idx != PMM_NO_FRAME) free_list_remove(0, idx);
+        else idx = buddy_alloc(0);
+
+        if (idx == PMM_NO_FRAME) break;
+
+        cache->frames[cache->count++] = idx;
+        used_frames++;
+    }
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+// Gives the oldest batch of a CPU cache back to the buddy lists
+static void pcp_drain(pmm_pcp_t *cache, u32 count) {
+    if (count > cache->count) count = cache->count;
+
+    u32 flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    for (u32 i = 0; i < count; i++)
+        buddy_free(cache->frames[i], 0);
+
+    used_frames -= count;
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+
+    cache->count -= count;
+    memmove(cache->frames, cache->frames + count, cache->count * sizeof(u32));
 }
 
 void pmm_init(uintptr_t kernel_end, u64 ram_size) {
@@ -40,113 +252,232 @@ void pmm_init(uintptr_t kernel_end, u64 ram_size) {
     phy_ram_end = PHY_RAM_BASE + phy_ram_size;
     total_frames = phy_ram_size / PAGE_SIZE;
 
-    uintptr_t stack_start = (kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    
-    size_t stack_size_bytes = total_frames * sizeof(u32);
-    
-    frame_stack = (u32*)stack_start;
+    uintptr_t meta_start = (kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-    ref_counts = (u8*)(stack_start + stack_size_bytes);
-    size_t ref_size_bytes = total_frames * sizeof(u8);
+    size_t pages_size_bytes = total_frames * sizeof(page_t);
 
-    stack_capacity = total_frames;
-    stack_top = 0;
+    pages = (page_t*)meta_start;
 
-    uintptr_t pmm_reserved_end = stack_start + stack_size_bytes + ref_size_bytes;
+    uintptr_t pmm_reserved_end = meta_start + pages_size_bytes;
+    u32 reserved_frames = (pmm_reserved_end - PHY_RAM_BASE + PAGE_SIZE - 1) >> PAGE_SHIFT;
 
-    kprintf("[PMM] Initializing Page Stack Allocator...\n");
-    kprintf("[PMM] Stack at 0x%x, Size: %d KB\n", frame_stack, stack_size_bytes / 1024);
+    kprintf("[PMM] Initializing Buddy Allocator...\n");
+    kprintf("[PMM] Page map at 0x%x, Size: %d KB\n", pages, pages_size_bytes / 1024);
 
-    for (u32 i = 0; i < total_frames; i++) {
-        uintptr_t addr = index_to_phys(i);
-        ref_counts[i] = 0;
+    for (u32 i = 0; i <= PMM_MAX_ORDER; i++)
+        free_lists[i] = PMM_NO_FRAME;
 
-        // If used don't push to stack, else push
-        if (addr >= PHY_RAM_BASE && addr < pmm_reserved_end) {
-            used_frames++;
-            ref_counts[i] = 1;
-        } else {
-            if (stack_top < stack_capacity)
-                frame_stack[stack_top++] = i;
-        }
+    memset(pages, 0, pages_size_bytes);
+
+    // Kernel image, DTB and the PMM metadata itself
+    for (u32 i = 0; i < reserved_frames; i++) {
+        pages[i].refcount = 1;
+        pages[i].flags = PG_RESERVED;
     }
 
-    kprintf("[PMM] Initialization complete. Free frames: %d\n", stack_top);
+    used_frames = reserved_frames;
+
+    buddy_free_range(reserved_frames, total_frames);
+
+    kprintf("[PMM] Initialization complete. Free frames: %d\n", free_frames);
+}
+
+// Called once the higher half linear map is live
+void pmm_relocate(uintptr_t offset) {
+    pages = (page_t*)((uintptr_t)pages + offset);
+    pmm_virt_offset = offset;
 }
 
+// Meant for boot, before frames start sitting in the per-CPU caches
 void pmm_mark_used_region(uintptr_t base, size_t size) {
     u32 start_idx = phys_to_index(base);
     u32 end_idx   = phys_to_index(base + size + PAGE_SIZE - 1);
 
     if (start_idx == (u32)-1) return;
+    if (end_idx == (u32)-1) end_idx = total_frames;
 
-    // This is linear with a stack, but is called just at the start of the kernel
-    for (u32 target = start_idx; target < end_idx; target++) {
-        for (u32 i = 0; i < stack_top; i++) {
-            if (frame_stack[i] == target) {
-                stack_top--;
-                frame_stack[i] = frame_stack[stack_top];
-                used_frames++;
-                break; 
-            }
-        }
-    }
+    u32 flags = spinlock_acquire_irqsave(&pmm_lock);
+    used_frames += buddy_reserve_range(start_idx, end_idx);
+    spinlock_release_irqrestore(&pmm_lock, flags);
 }
 
-uintptr_t pmm_alloc_frame() {
+uintptr_t pmm_alloc_pages(u32 order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
     u32 flags = spinlock_acquire_irqsave(&pmm_lock);
 
-    // O(1) with a stack
-    if (stack_top == 0) {
-        kprintf("[ [CPMM [W] CRITICAL: Out of Memory!\n");
-        
+    u32 idx = buddy_alloc(order);
+    if (idx == PMM_NO_FRAME) {
+        kprintf("[ [CPMM [W] CRITICAL: Out of Memory! (order %d)\n", order);
+
         spinlock_release_irqrestore(&pmm_lock, flags);
         return 0;
     }
 
-    // Pop from stack
-    stack_top--;
-    u32 idx = frame_stack[stack_top];
-    used_frames++;
+    u32 count = 1U << order;
+    for (u32 i = 0; i < count; i++)
+        pages[idx + i].refcount = 1;
+
+    used_frames += count;
 
-    ref_counts[idx] = 1;
-    
     spinlock_release_irqrestore(&pmm_lock, flags);
     return index_to_phys(idx);
 }
 
-void pmm_free_frame(uintptr_t addr) {
+void pmm_free_pages(uintptr_t addr, u32 order) {
+    u32 idx = phys_to_index(addr);
+
+    if (idx == (u32)-1 || order > PMM_MAX_ORDER || (idx & ((1U << order) - 1)))
+        return;
+
     u32 flags = spinlock_acquire_irqsave(&pmm_lock);
 
+    u32 count = 1U << order;
+    for (u32 i = 0; i < count; i++) {
+        pages[idx + i].refcount = 0;
+        pages[idx + i].mapcount = 0;
+        pages[idx + i].flags = 0;
+        pages[idx + i].owner = NULL;
+    }
+
+    used_frames -= count;
+    buddy_free(idx, order);
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+uintptr_t pmm_alloc_frame() {
+    u32 cpu = smp_cpu_id();
+    if (cpu >= MAX_CPUS) return pmm_alloc_pages(0);
+
+    // IRQs are masked only locally, the cache belongs to this core
+    u32 flags = local_irq_save();
+
+    pmm_pcp_t *cache = &pcp[cpu];
+    if (cache->count == 0) pcp_refill(cache);
+
+    if (cache->count == 0) {
+        local_irq_restore(flags);
+
+        // Last resort: frames parked in the zeroed pool
+        u32 zflags = spinlock_acquire_irqsave(&zero_lock);
+        uintptr_t phys = zero_count ? zero_pool[--zero_count] : 0;
+        spinlock_release_irqrestore(&zero_lock, zflags);
+
+        if (!phys) kprintf("[ [CPMM [W] CRITICAL: Out of Memory!\n");
+        return phys;
+    }
+
+    u32 idx = cache->frames[--cache->count];
+    __atomic_store_n(&pages[idx].refcount, 1, __ATOMIC_RELAXED);
+
+    local_irq_restore(flags);
+    return index_to_phys(idx);
+}
+
+void pmm_free_frame(uintptr_t addr) {
     u32 idx = phys_to_index(addr);
-    
-    if (idx == (u32)-1 || idx >= total_frames) {
-        spinlock_release_irqrestore(&pmm_lock, flags);
+
+    if (idx == (u32)-1 || idx >= total_frames)
         return;
-    }
 
-    if (ref_counts[idx] > 0) {
-        ref_counts[idx]--;
-        
-        if (ref_counts[idx] == 0) {
-            frame_stack[stack_top++] = idx;
-            used_frames--;
-        }
+    if (!pmm_dec_ref(idx))
+        return;
 
+    u32 cpu = smp_cpu_id();
+    if (cpu >= MAX_CPUS) {
+        u32 flags = spinlock_acquire_irqsave(&pmm_lock);
+        used_frames--;
+        buddy_free(idx, 0);
         spinlock_release_irqrestore(&pmm_lock, flags);
         return;
     }
 
-    // Safety check to not overflow the stack
-    if (stack_top >= stack_capacity) {
-        kprintf("[ [CPMM [W] Error: Stack overflow on free!\n");
-        spinlock_release_irqrestore(&pmm_lock, flags);
-        return;
+    u32 flags = local_irq_save();
+
+    pmm_pcp_t *cache = &pcp[cpu];
+    if (cache->count >= PCP_HIGH) pcp_drain(cache, PCP_BATCH);
+
+    cache->frames[cache->count++] = idx;
+
+    local_irq_restore(flags);
+}
+
+uintptr_t pmm_alloc_zeroed_frame() {
+    u32 flags = spinlock_acquire_irqsave(&zero_lock);
+    uintptr_t phys = zero_count ? zero_pool[--zero_count] : 0;
+    spinlock_release_irqrestore(&zero_lock, flags);
+
+    if (phys) return phys;
+
+    // Pool is dry, zero on the spot
+    phys = pmm_alloc_frame();
+    if (phys) memset((void*)(phys + pmm_virt_offset), 0, PAGE_SIZE);
+
+    return phys;
+}
+
+// Zeroes one frame into the pool, returns false once there is nothing left to do
+bool pmm_refill_zeroed() {
+    if (!pmm_virt_offset || __atomic_load_n(&zero_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE)
+        return false;
+
+    uintptr_t phys = pmm_alloc_frame();
+    if (!phys) return false;
+
+    // Zero outside of any lock with interrupts on
+    memset((void*)(phys + pmm_virt_offset), 0, PAGE_SIZE);
+
+    u32 flags = spinlock_acquire_irqsave(&zero_lock);
+    if (zero_count < ZERO_POOL_SIZE) {
+        zero_pool[zero_count++] = phys;
+        spinlock_release_irqrestore(&zero_lock, flags);
+        return true;
     }
 
-    // Push to stack
-    frame_stack[stack_top++] = idx;
-    used_frames--;
+    spinlock_release_irqrestore(&zero_lock, flags);
+    pmm_free_frame(phys);
+    return false;
+}
+
+#ifdef PMM_BENCH
+#define PMM_BENCH_ROUNDS    4096
+#define PMM_BENCH_DEPTH     64
 
-    spinlock_release_irqrestore(&pmm_lock, flags);
-}
\ No newline at end of file
+static volatile u32 bench_arrived = 0;
+
+// Run on every core at once: each core allocates and frees bursts of single
+// frames so the refill/drain paths and pmm_lock see real contention
+void pmm_benchmark() {
+    uintptr_t held[PMM_BENCH_DEPTH];
+    u64 start, end, freq;
+
+    u32 cpu = smp_cpu_id();
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(start));
+
+    // Wait up to a second for the other cores so a core that failed to boot can't hang us
+    __atomic_add_fetch(&bench_arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&bench_arrived, __ATOMIC_ACQUIRE) < MAX_CPUS) {
+        asm volatile("isb; mrs %0, cntpct_el0" : "=r"(end));
+        if (end - start > freq) break;
+    }
+
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(start));
+
+    for (u32 round = 0; round < PMM_BENCH_ROUNDS; round++) {
+        for (u32 i = 0; i < PMM_BENCH_DEPTH; i++)
+            held[i] = pmm_alloc_frame();
+
+        for (u32 i = 0; i < PMM_BENCH_DEPTH; i++)
+            if (held[i]) pmm_free_frame(held[i]);
+    }
+
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(end));
+
+    u64 ops = (u64)PMM_BENCH_ROUNDS * PMM_BENCH_DEPTH;
+    kprintf("[ [CPMM [W] CPU %d: %llu alloc/free pairs in %llu us (%llu ns each)\n",
+            cpu, ops, (end - start) * 1000000 / freq, (end - start) * 1000000000 / freq / ops);
+}
+#endif
@@ -0,0 +1,55 @@
+#include <tlb.h>
+#include <asid.h>
+#include <pmm.h>
+#include <vmm.h>
+
+// Batches are flushed when the frame array fills, so a huge unmap costs
+// one TLBI round per TLB_GATHER_FRAMES pages instead of one per page
+
+void tlb_gather_init(mmu_gather_t* tlb, mm_struct_t* mm, bool fullmm) {
+    tlb->mm = mm;
+    tlb->start = ~0ULL;
+    tlb->end = 0;
+    tlb->fullmm = fullmm;
+    tlb->nr_frames = 0;
+}
+
+// Records a PTE that changed, the TLB entry goes at the next flush
+void tlb_gather_page(mmu_gather_t* tlb, uintptr_t addr) {
+    addr &= ~(PAGE_SIZE - 1);
+
+    if (addr < tlb->start) tlb->start = addr;
+    if (addr + PAGE_SIZE > tlb->end) tlb->end = addr + PAGE_SIZE;
+}
+
+// Records a cleared PTE whose frame may only be freed once no TLB can reach it
+void tlb_gather_free(mmu_gather_t* tlb, uintptr_t addr, u64 phys) {
+    tlb_gather_page(tlb, addr);
+
+    tlb->frames[tlb->nr_frames++] = phys;
+    if (tlb->nr_frames == TLB_GATHER_FRAMES)
+        tlb_gather_flush(tlb);
+}
+
+void tlb_gather_flush(mmu_gather_t* tlb) {
+    if (tlb->end > tlb->start) {
+        u64 pages = (tlb->end - tlb->start) / PAGE_SIZE;
+
+        if (tlb->fullmm || pages > TLB_RANGE_PAGES) {
+            tlb_flush_mm(tlb->mm);
+        } else {
+            tlb_flush_mm_range(tlb->mm, tlb->start, tlb->end);
+        }
+    }
+
+    for (u32 i = 0; i < tlb->nr_frames; i++)
+        pmm_free_frame(tlb->frames[i]);
+
+    tlb->start = ~0ULL;
+    tlb->end = 0;
+    tlb->nr_frames = 0;
+}
+
+void tlb_gather_finish(mmu_gather_t* tlb) {
+    tlb_gather_flush(tlb);
+}
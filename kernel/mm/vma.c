@@ -4,30 +4,56 @@
 #include <string.h>
 #include <kio.h>
 #include <spinlock.h>
+#include <sync.h>
 #include <vmm.h>
+#include <asid.h>
+#include <tlb.h>
 
-static spinlock_t vma_lock = 0;
+static kmem_cache_t *mm_cache = NULL;
+static kmem_cache_t *vma_cache = NULL;
+
+u32 fault_around_pages = FAULT_AROUND_PAGES;
+u64 fault_around_avoided = 0;
+
+// Read faults on anonymous memory all map this frame read-only, the first
+// write breaks COW into a private zeroed frame. It is never refcounted or freed.
+static u64 zero_page = 0;
+
+void vma_init() {
+    mm_cache = kmem_cache_create("mm_struct_t", sizeof(mm_struct_t), 0, NULL);
+    vma_cache = kmem_cache_create("vma_t", sizeof(vma_t), 0, NULL);
+    
+    zero_page = pmm_alloc_zeroed_frame();
+    if (!zero_page)
+        kprintf("[ [RVMA [W] No frame for the zero page\n");
+}
+
+static inline bool is_zero_page(u64 phys) {
+    return zero_page && phys == zero_page;
+}
 
 mm_struct_t* mm_create() {
-    mm_struct_t* mm = (mm_struct_t*)kmalloc(sizeof(mm_struct_t));
+    mm_struct_t* mm = (mm_struct_t*)kmem_cache_alloc(mm_cache);
     if (!mm) return NULL;
     
     memset(mm, 0, sizeof(mm_struct_t));
     
-    u64 pt_phys = pmm_alloc_frame();
+    u64 pt_phys = pmm_alloc_zeroed_frame();
     if (!pt_phys) {
-        kfree(mm);
+        kmem_cache_free(mm_cache, mm);
         return NULL;
     }
     
-    memset(P2V(pt_phys), 0, PAGE_SIZE);
-    
     mm->page_table = (u64*)pt_phys;
     mm->vma_list = NULL;
+    mm->vma_root = NULL;
     mm->heap_start = USER_HEAP_START;
     mm->heap_end = USER_HEAP_START;
     mm->stack_start = USER_STACK_TOP;
     mm->mmap_base = USER_MMAP_BASE;
+    rwsem_init(&mm->mmap_lock);
+    mm->page_table_lock = 0;
+    mm->ttbr_users = 1;
     
     vma_t* stack = vma_create(
         USER_STACK_TOP - USER_STACK_SIZE,
@@ -42,27 +68,86 @@ mm_struct_t* mm_create() {
     return mm;
 }
 
+// Clears the PTEs of [start, end) inside vma by walking the tables, so an
+// unpopulated 1GB or 2MB span costs one check. Device frames are not ours to free.
+static void zap_range(mm_struct_t* mm, vma_t* vma, uintptr_t start, uintptr_t end, mmu_gather_t* tlb) {
+    u64* l1_table = (u64*)P2V((uintptr_t)mm->page_table);
+    uintptr_t addr = start;
+
+    while (addr < end) {
+        uintptr_t l1_end = (addr | (L1_BLOCK_SIZE - 1)) + 1;
+        if (l1_end > end) l1_end = end;
+
+        u64 l1 = l1_table[(addr >> 30) & 0x1FF];
+        if (!(l1 & PT_VALID)) {
+            addr = l1_end;
+            continue;
+        }
+
+        u64* l2_table = (u64*)P2V(l1 & 0x0000FFFFFFFFF000ULL);
+        while (addr < l1_end) {
+            uintptr_t l2_end = (addr | (L2_BLOCK_SIZE - 1)) + 1;
+            if (l2_end > l1_end) l2_end = l1_end;
+
+            u64 l2 = l2_table[(addr >> 21) & 0x1FF];
+            if (!(l2 & PT_VALID)) {
+                addr = l2_end;
+                continue;
+            }
+
+            u64* l3_table = (u64*)P2V(l2 & 0x0000FFFFFFFFF000ULL);
+            for (; addr < l2_end; addr += PAGE_SIZE) {
+                u64* pte = &l3_table[(addr >> 12) & 0x1FF];
+                if (!(*pte & PT_VALID)) continue;
+
+                u64 phys = *pte & 0x0000FFFFFFFFF000ULL;
+                *pte = 0;
+
+                if (vma->vm_type != VMA_DEVICE && !is_zero_page(phys)) {
+                    page_t* page = phys_to_page(phys);
+                    if (page->flags & PG_PAGECACHE)
+                        page_map_dec(page);
+                    
+                    tlb_gather_free(tlb, addr, phys);
+                } else tlb_gather_page(tlb, addr);
+            }
+        }
+    }
+}
+
 void mm_destroy(mm_struct_t* mm) {
     if (!mm) return;
-    
-    u32 flags = spinlock_acquire_irqsave(&vma_lock);
+
+    // Last reference, nobody else can fault or map in here anymore
+    switch_mm_drop(mm);
+
+    mmu_gather_t tlb;
+    tlb_gather_init(&tlb, mm, true);
     
     vma_t* vma = mm->vma_list;
     while (vma) {
         vma_t* next = vma->vm_next;
         
-        for (uintptr_t addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
-            u64* pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), addr);
-            if (pte && (*pte & PT_VALID)) {
-                u64 phys = *pte & 0x0000FFFFFFFFF000ULL;
-                pmm_free_frame(phys);
-                *pte = 0;
-            }
-        }
+        zap_range(mm, vma, vma->vm_start, vma->vm_end, &tlb);
         
-        kfree(vma);
+        vma_free(vma);
         vma = next;
     }
+    mm->vma_list = NULL;
+    mm->vma_root = NULL;
+
+    // Drop whatever this ASID still caches before the tables go away
+    tlb_gather_finish(&tlb);
+    
+    // CPUs still borrowing the mm keep walking its tables, the last one to switch away frees them
+    if (switch_mm_put(mm))
+        mm_free_tables(mm);
+}
+
+// Frees the page tables of a destroyed mm once no TTBR0 points at them
+void mm_free_tables(mm_struct_t* mm) {
+    // A borrowing CPU may have cached walks since the teardown flush
+    tlb_flush_mm(mm);
     
     u64* l1_table = (u64*)P2V((uintptr_t)mm->page_table);
     for (int i = 0; i < 512; i++) {
@@ -79,8 +164,7 @@ void mm_destroy(mm_struct_t* mm) {
     }
     pmm_free_frame(V2P(l1_table));
     
-    spinlock_release_irqrestore(&vma_lock, flags);
-    kfree(mm);
+    kmem_cache_free(mm_cache, mm);
 }
 
 vma_t* vma_create(uintptr_t start, uintptr_t end, u32 flags, u8 type) {
@@ -88,7 +172,7 @@ vma_t* vma_create(uintptr_t start, uintptr_t end, u32 flags, u8 type) {
         return NULL;
     }
     
-    vma_t* vma = (vma_t*)kmalloc(sizeof(vma_t));
+    vma_t* vma = (vma_t*)kmem_cache_alloc(vma_cache);
     if (!vma) return NULL;
     
     memset(vma, 0, sizeof(vma_t));
@@ -103,138 +187,165 @@ vma_t* vma_create(uintptr_t start, uintptr_t end, u32 flags, u8 type) {
     return vma;
 }
 
-// Insert VMA into address space (sorted by start address)
-int vma_insert(mm_struct_t* mm, vma_t* new_vma) {
-    if (!mm || !new_vma) return -1;
+void vma_free(vma_t* vma) {
+    // Mappings keep their file open
+    if (vma->vm_file) vfs_close(vma->vm_file);
     
-    u32 flags = spinlock_acquire_irqsave(&vma_lock);
+    kmem_cache_free(vma_cache, vma);
+}
+
+// True if b starts where a ends and simply continues it
+static bool vma_can_merge(vma_t* a, vma_t* b) {
+    if (a->vm_end != b->vm_start) return false;
+    if (a->vm_flags != b->vm_flags || a->vm_type != b->vm_type) return false;
     
-    // Check for overlaps
-    vma_t* vma = mm->vma_list;
-    while (vma) {
-        if (!(new_vma->vm_end <= vma->vm_start || new_vma->vm_start >= vma->vm_end)) {
-            spinlock_release_irqrestore(&vma_lock, flags);
-            return -1;  // Overlap detected
-        }
+    // Device VMAs don't know their physical base, keep them apart
+    if (a->vm_type == VMA_DEVICE) return false;
+    
+    if (a->vm_file != b->vm_file) return false;
+    if (a->vm_file && a->vm_pgoff + (a->vm_end - a->vm_start) != b->vm_pgoff) return false;
+    
+    return true;
+}
+
+// Folds vma into the neighbours it continues, so back to back mmaps with the
+// same protection stay one VMA. Returns the VMA now covering vma's range.
+static vma_t* vma_merge(mm_struct_t* mm, vma_t* vma) {
+    vma_t* prev = vma->vm_prev;
+    if (prev && vma_can_merge(prev, vma)) {
+        vma_tree_remove(mm, vma);
+        prev->vm_end = vma->vm_end;
+        vma_tree_update(mm, prev);
         
-        vma = vma->vm_next;
+        vma_free(vma);
+        vma = prev;
     }
     
-    // Insert in sorted order
-    if (!mm->vma_list || new_vma->vm_start < mm->vma_list->vm_start) {
-        new_vma->vm_next = mm->vma_list;
-        mm->vma_list = new_vma;
-    } else {
-        vma_t* prev = mm->vma_list;
-
-        while (prev->vm_next && prev->vm_next->vm_start < new_vma->vm_start)
-            prev = prev->vm_next;
-
-        new_vma->vm_next = prev->vm_next;
-        prev->vm_next = new_vma;
+    vma_t* next = vma->vm_next;
+    if (next && vma_can_merge(vma, next)) {
+        vma_tree_remove(mm, next);
+        vma->vm_end = next->vm_end;
+        vma_tree_update(mm, vma);
+        
+        vma_free(next);
     }
     
-    spinlock_release_irqrestore(&vma_lock, flags);
+    return vma;
+}
+
+// Insert VMA into address space (sorted by start address), caller holds mmap_lock
+// for writing. new_vma may be merged into a neighbour and freed.
+int vma_insert_locked(mm_struct_t* mm, vma_t* new_vma) {
+    // Check for overlaps
+    vma_t* vma = vma_tree_find_next(mm, new_vma->vm_start);
+    if (vma && vma->vm_start < new_vma->vm_end)
+        return -1;  // Overlap detected
+    
+    vma_tree_insert(mm, new_vma);
+    vma_merge(mm, new_vma);
     return 0;
 }
 
+int vma_insert(mm_struct_t* mm, vma_t* new_vma) {
+    if (!mm || !new_vma) return -1;
+    
+    rwsem_write_acquire(&mm->mmap_lock);
+    int ret = vma_insert_locked(mm, new_vma);
+    rwsem_write_release(&mm->mmap_lock);
+    
+    return ret;
+}
+
 // Find VMA containing address
 vma_t* vma_find(mm_struct_t* mm, uintptr_t addr) {
     if (!mm) return NULL;
     
-    u32 flags = spinlock_acquire_irqsave(&vma_lock);
+    rwsem_read_acquire(&mm->mmap_lock);
+    vma_t* vma = vma_tree_find(mm, addr);
+    rwsem_read_release(&mm->mmap_lock);
     
-    vma_t* vma = mm->vma_list;
-    while (vma) {
-        if (addr >= vma->vm_start && addr < vma->vm_end) {
-            spinlock_release_irqrestore(&vma_lock, flags);
-            return vma;
-        }
+    return vma;
+}
 
-        vma = vma->vm_next;
+// Splits vma at addr, the upper part becomes a new VMA which is returned.
+// Caller holds mmap_lock for writing.
+static vma_t* vma_split(mm_struct_t* mm, vma_t* vma, uintptr_t addr) {
+    vma_t* upper = vma_create(addr, vma->vm_end, vma->vm_flags, vma->vm_type);
+    if (!upper) return NULL;
+    
+    if (vma->vm_file) {
+        upper->vm_file = vma->vm_file;
+        upper->vm_pgoff = vma->vm_pgoff + (addr - vma->vm_start);
+        vfs_retain(vma->vm_file);
     }
     
-    spinlock_release_irqrestore(&vma_lock, flags);
-    return NULL;
+    vma->vm_end = addr;
+    vma_tree_update(mm, vma);
+    
+    vma_tree_insert(mm, upper);
+    return upper;
 }
 
 int vma_unmap(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
     if (!mm || start >= end) return -1;
     
-    u32 flags = spinlock_acquire_irqsave(&vma_lock);
+    rwsem_write_acquire(&mm->mmap_lock);
+
+    mmu_gather_t tlb;
+    tlb_gather_init(&tlb, mm, false);
     
-    vma_t* vma = mm->vma_list;
-    vma_t* prev = NULL;
+    // Every VMA from the first one ending above start overlaps, until one starts past end
+    vma_t* vma = vma_tree_find_next(mm, start);
     
-    while (vma) {
+    while (vma && vma->vm_start < end) {
         vma_t* next = vma->vm_next;
         
-        // Check if this VMA overlaps with the range to unmap
-        if (vma->vm_end <= start || vma->vm_start >= end) {
-            prev = vma;
-            vma = next;
-            continue;
-        }
-        
-        #define FREE_PAGES(s, e) do { \
-            for (uintptr_t addr = (s); addr < (e); addr += PAGE_SIZE) { \
-                u64* pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), addr); \
-                if (pte && (*pte & PT_VALID)) { \
-                    if (vma->vm_type != VMA_DEVICE) { \
-                        u64 phys = *pte & 0x0000FFFFFFFFF000ULL; \
-                        pmm_free_frame(phys); \
-                    } \
-                    *pte = 0; \
-                } \
-            } \
-        } while(0)
-
         // Case 1: Complete overlap - remove entire VMA
         if (start <= vma->vm_start && end >= vma->vm_end) {
-            FREE_PAGES(vma->vm_start, vma->vm_end);
+            zap_range(mm, vma, vma->vm_start, vma->vm_end, &tlb);
             
-            if (prev) prev->vm_next = next;
-            else mm->vma_list = next;
+            vma_tree_remove(mm, vma);
             
-            kfree(vma);
+            vma_free(vma);
             vma = next;
             continue;
         }
         
         // Case 2: Partial overlap at start
         if (start <= vma->vm_start && end < vma->vm_end) {
-            FREE_PAGES(vma->vm_start, end);
+            zap_range(mm, vma, vma->vm_start, end, &tlb);
+            if (vma->vm_file) vma->vm_pgoff += end - vma->vm_start;
             vma->vm_start = end;
+            vma_tree_update(mm, vma);
         }
         
         // Case 3: Partial overlap at end
         else if (start > vma->vm_start && end >= vma->vm_end) {
-            FREE_PAGES(start, vma->vm_end);
+            zap_range(mm, vma, start, vma->vm_end, &tlb);
             vma->vm_end = start;
+            vma_tree_update(mm, vma);
         }
         
         // Case 4: Hole in middle - split VMA
         else if (start > vma->vm_start && end < vma->vm_end) {
-            vma_t* new_vma = vma_create(end, vma->vm_end, vma->vm_flags, vma->vm_type);
-
-            if (!new_vma) {
-                spinlock_release_irqrestore(&vma_lock, flags);
+            if (!vma_split(mm, vma, end)) {
+                tlb_gather_finish(&tlb);
+                rwsem_write_release(&mm->mmap_lock);
                 return -1;
             }
             
-            FREE_PAGES(start, end);
+            zap_range(mm, vma, start, end, &tlb);
             
             vma->vm_end = start;
-            
-            new_vma->vm_next = vma->vm_next;
-            vma->vm_next = new_vma;
+            vma_tree_update(mm, vma);
         }
         
-        prev = vma;
         vma = next;
     }
+
+    tlb_gather_finish(&tlb);
     
-    spinlock_release_irqrestore(&vma_lock, flags);
+    rwsem_write_release(&mm->mmap_lock);
     return 0;
 }
 
@@ -245,41 +356,33 @@ uintptr_t vma_allocate(mm_struct_t* mm, uintptr_t addr, size_t length, u32 flags
     // Align length to page boundary
     length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
-    u32 lock_flags = spinlock_acquire_irqsave(&vma_lock);
+    // Search and insert under one hold so nobody takes the hole in between
+    rwsem_write_acquire(&mm->mmap_lock);
     
     // If addr is 0, find a suitable location
     if (addr == 0) {
-        addr = mm->mmap_base;
-        
-        // Find free space
-        vma_t* vma = mm->vma_list;
-        while (vma) {
-            if (addr + length <= vma->vm_start)
-                break;
-
-            if (addr < vma->vm_end)
-                addr = vma->vm_end;
-
-            vma = vma->vm_next;
-        }
+        addr = vma_tree_unmapped_area(mm, mm->mmap_base, length);
         
         // Check if ran out of space
-        if (addr + length > USER_SPACE_END) {
-            spinlock_release_irqrestore(&vma_lock, lock_flags);
+        if (addr == 0) {
+            rwsem_write_release(&mm->mmap_lock);
             return 0;
         }
     }
     
-    spinlock_release_irqrestore(&vma_lock, lock_flags);
-    
     vma_t* new_vma = vma_create(addr, addr + length, flags, VMA_ANONYMOUS);
-    if (!new_vma) return 0;
+    if (!new_vma) {
+        rwsem_write_release(&mm->mmap_lock);
+        return 0;
+    }
     
-    if (vma_insert(mm, new_vma) < 0) {
-        kfree(new_vma);
+    if (vma_insert_locked(mm, new_vma) < 0) {
+        rwsem_write_release(&mm->mmap_lock);
+        vma_free(new_vma);
         return 0;
     }
     
+    rwsem_write_release(&mm->mmap_lock);
     return addr;
 }
 
@@ -289,140 +392,532 @@ uintptr_t vma_allocate_file(mm_struct_t* mm, uintptr_t addr, size_t length, u32
     // Align length to page boundary
     length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
-    u32 lock_flags = spinlock_acquire_irqsave(&vma_lock);
+    rwsem_write_acquire(&mm->mmap_lock);
     
     if (addr == 0) {
-        addr = mm->mmap_base;
-        
-        vma_t* vma = mm->vma_list;
-        while (vma) {
-            if (addr + length <= vma->vm_start)
-                break;
-
-            if (addr < vma->vm_end)
-                addr = vma->vm_end;
-
-            vma = vma->vm_next;
-        }
+        addr = vma_tree_unmapped_area(mm, mm->mmap_base, length);
         
-        if (addr + length > USER_SPACE_END) {
-            spinlock_release_irqrestore(&vma_lock, lock_flags);
+        if (addr == 0) {
+            rwsem_write_release(&mm->mmap_lock);
             return 0;
         }
     }
     
-    spinlock_release_irqrestore(&vma_lock, lock_flags);
-    
     vma_t* new_vma = vma_create(addr, addr + length, flags, VMA_FILE);
-    if (!new_vma) return 0;
+    if (!new_vma) {
+        rwsem_write_release(&mm->mmap_lock);
+        return 0;
+    }
     
     new_vma->vm_file = file;
     new_vma->vm_pgoff = offset;
+    vfs_retain(file);
     
-    if (vma_insert(mm, new_vma) < 0) {
-        kfree(new_vma);
+    if (vma_insert_locked(mm, new_vma) < 0) {
+        rwsem_write_release(&mm->mmap_lock);
+        vma_free(new_vma);
         return 0;
     }
     
+    rwsem_write_release(&mm->mmap_lock);
     return addr;
 }
 
-// Handle page fault in user space
-int vma_page_fault(mm_struct_t* mm, uintptr_t addr, bool is_write) {
-    if (!mm) return -1;
+// Leaf descriptor bits for a page of vma, minus the frame address
+static u64 vma_pte_attrs(vma_t* vma) {
+    u64 attrs = PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER | PT_NG;
+    attrs |= (MT_NORMAL << 2);  // Normal memory
     
-    vma_t* vma = vma_find(mm, addr);
-    if (!vma) {
-        // Check if this could be stack expansion
-        if (addr < USER_STACK_TOP && addr >= USER_STACK_TOP - USER_STACK_SIZE * 2)
-            return vma_expand_stack(mm, addr);
+    if (vma->vm_flags & VMA_WRITE)
+        attrs |= PT_AP_RW_EL0;  // User accessible
+    else
+        attrs |= PT_AP_RO_EL0;
+    
+    if (!(vma->vm_flags & VMA_EXEC))
+        attrs |= PT_UXN;        // User execute never
+    
+    return attrs;
+}
 
-        return -1;  // No VMA covers this address
+// Page cache frames start read-only. Private writable ones break COW on the
+// first write, shared ones go writable once that write marks the page dirty.
+static u64 file_pte_attrs(vma_t* vma, bool is_write) {
+    u64 attrs = vma_pte_attrs(vma);
+    bool shared = vma->vm_flags & VMA_SHARED;
+    
+    if (!(vma->vm_flags & VMA_WRITE) || (shared && is_write))
+        return attrs;
+    
+    attrs = (attrs & ~(3ULL << 6)) | PT_AP_RO_EL0;
+    if (!shared) attrs |= PT_SW_COW;
+    
+    return attrs;
+}
+
+// Shared anonymous pages must be the same frame in every process that maps them,
+// a COW break on the zero page would give each one its own copy
+static inline bool vma_maps_zero_page(vma_t* vma) {
+    return zero_page && vma->vm_type == VMA_ANONYMOUS && !(vma->vm_flags & VMA_SHARED);
+}
+
+// The zero page is read-only everywhere, writable private VMAs break COW on it
+static u64 zero_pte_attrs(vma_t* vma) {
+    u64 attrs = vma_pte_attrs(vma);
+    if (!(vma->vm_flags & VMA_WRITE))
+        return attrs;
+    
+    return (attrs & ~(3ULL << 6)) | PT_AP_RO_EL0 | PT_SW_COW;
+}
+
+// Drops the reference a user PTE held on phys
+static void put_user_frame(u64 phys) {
+    if (is_zero_page(phys)) return;
+    
+    page_t* page = phys_to_page(phys);
+    if (page->flags & PG_PAGECACHE)
+        page_map_dec(page);
+    
+    pmm_free_frame(phys);
+}
+
+// Populates the empty PTEs of the aligned window around addr so sequential
+// readers don't trap on every page. File pages are only taken if already cached,
+// the walk stops at the first miss rather than reading from disk under the fault.
+// Private anonymous ones all map the zero page. The window never leaves the L3 table of addr.
+static void fault_around(mm_struct_t* mm, vma_t* vma, uintptr_t addr, u64* pte) {
+    u64 nr = __atomic_load_n(&fault_around_pages, __ATOMIC_RELAXED);
+    if (nr <= 1 || (vma->vm_flags & VMA_RAND_READ)) return;
+    
+    // Sequential readers get a wider window, still within one L3 table
+    if (vma->vm_flags & VMA_SEQ_READ)
+        nr = nr * 4 > 512 ? 512 : nr * 4;
+    
+    uintptr_t start = addr & ~(nr * PAGE_SIZE - 1);
+    uintptr_t end = start + nr * PAGE_SIZE;
+    if (start < vma->vm_start) start = vma->vm_start;
+    if (end > vma->vm_end) end = vma->vm_end;
+    
+    bool file = vma->vm_type == VMA_FILE && vma->vm_file;
+    if (!file && !vma_maps_zero_page(vma)) return;
+    
+    if (file) {
+        // Nothing to read past EOF
+        u64 size = vma->vm_file->size;
+        if (size <= vma->vm_pgoff) return;
+        
+        uintptr_t eof = vma->vm_start + ((size - vma->vm_pgoff + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        if (eof < end) end = eof;
+    }
+    
+    u64* table = pte - ((addr >> 12) & 0x1FF);
+    u64 attrs = file ? file_pte_attrs(vma, false) : zero_pte_attrs(vma);
+    uintptr_t page = addr & ~(PAGE_SIZE - 1);
+    u64 mapped = 0;
+    
+    // Ahead of the fault first, then behind it, each direction up to its first miss
+    for (int dir = 0; dir < 2; dir++) {
+        uintptr_t a = dir ? page - PAGE_SIZE : page + PAGE_SIZE;
+        
+        for (; a >= start && a < end; a = dir ? a - PAGE_SIZE : a + PAGE_SIZE) {
+            u64* p = &table[(a >> 12) & 0x1FF];
+            if (*p & PT_VALID) continue;
+            
+            u64 phys = file ? vfs_map_cached_page(vma->vm_file, vma->vm_pgoff + (a - vma->vm_start)) : zero_page;
+            if (!phys) break;
+            
+            u32 flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+            if (*p & PT_VALID) {
+                spinlock_release_irqrestore(&mm->page_table_lock, flags);
+                put_user_frame(phys);
+                continue;
+            }
+            *p = phys | attrs;
+            spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            
+            mapped++;
+        }
     }
     
+    if (mapped) {
+        asm volatile("dsb ishst" ::: "memory");
+        asm volatile("isb");
+        
+        __atomic_add_fetch(&fault_around_avoided, mapped, __ATOMIC_RELAXED);
+    }
+}
+
+// Resolves a fault inside vma, caller holds mmap_lock for reading. Other threads
+// can fault on the same page, so PTEs are only written under page_table_lock
+// after checking nobody beat us to it. Frame allocation and file reads happen outside it.
+static int handle_vma_fault(mm_struct_t* mm, vma_t* vma, uintptr_t addr, bool is_write) {
     if (is_write && !(vma->vm_flags & VMA_WRITE))
         return -1;  // Write to read-only memory
     
+    bool file = vma->vm_type == VMA_FILE && vma->vm_file;
+    bool shared = vma->vm_flags & VMA_SHARED;
+    u64 file_offset = vma->vm_pgoff + ((addr & ~(PAGE_SIZE - 1)) - vma->vm_start);
+    
+    u32 flags = spinlock_acquire_irqsave(&mm->page_table_lock);
     u64* pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)mm->page_table), addr);
+    u64 old = pte ? *pte : 0;
+    spinlock_release_irqrestore(&mm->page_table_lock, flags);
+    
     if (!pte) return -1;
     
-    if (!(*pte & PT_VALID)) {
-        u64 phys = pmm_alloc_frame();
-        if (!phys) return -1;
+    if (!(old & PT_VALID)) {
+        u64 phys = 0;
+        u64 entry;
         
-        memset(P2V(phys), 0, PAGE_SIZE);
+        // Map the cached file page itself, a private write gets its own copy right away
+        if (file && (shared || !is_write))
+            phys = vfs_map_page(vma->vm_file, file_offset);
         
-        // Handle file-backed mapping
-        if (vma->vm_type == VMA_FILE && vma->vm_file) {
-            u64 page_offset = (addr & ~(PAGE_SIZE - 1)) - vma->vm_start;
-            u64 file_offset = vma->vm_pgoff + page_offset;
-            vfs_read(vma->vm_file, file_offset, PAGE_SIZE, P2V(phys));
+        if (phys) {
+            entry = phys | file_pte_attrs(vma, is_write);
+            if (shared && is_write)
+                vfs_dirty_page(vma->vm_file, file_offset);
+        } else if (!is_write && vma_maps_zero_page(vma)) {
+            phys = zero_page;
+            entry = phys | zero_pte_attrs(vma);
+        } else {
+            phys = pmm_alloc_zeroed_frame();
+            if (!phys) return -1;
+            
+            // Private copy of the file, or zeroes past EOF
+            if (file)
+                vfs_read(vma->vm_file, file_offset, PAGE_SIZE, P2V(phys));
+            
+            entry = phys | vma_pte_attrs(vma);
         }
         
-        u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
-        entry |= (MT_NORMAL << 2);  // Normal memory
-        entry |= PT_AP_RW_EL0;      // User accessible
-        
-        if (!(vma->vm_flags & VMA_WRITE)) {
-            entry &= ~(1ULL << 7);  // Clear AP[2] to make read-only
-            entry |= PT_AP_RO_EL0;
+        flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+        if (*pte & PT_VALID) {
+            // Another thread populated it meanwhile
+            spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            put_user_frame(phys);
+            return 0;
         }
         
-        if (!(vma->vm_flags & VMA_EXEC))
-            entry |= PT_UXN;  // User execute never
-        
         *pte = entry;
         
-        asm volatile("tlbi vaale1is, %0" :: "r"(addr >> 12));
-        asm volatile("dsb ish");
+        // Invalid entries are never cached, publishing the new one is enough
+        asm volatile("dsb ishst" ::: "memory");
         asm volatile("isb");
         
+        spinlock_release_irqrestore(&mm->page_table_lock, flags);
+        
+        if (!is_write)
+            fault_around(mm, vma, addr, pte);
+        
         return 0;
     }
     
-    if (is_write && (*pte & PT_SW_COW)) {
-        u64 old_phys = *pte & 0x0000FFFFFFFFF000ULL;
-        u64 new_phys = pmm_alloc_frame();
-        if (!new_phys) return -1;
+    // First write to a clean shared file page since it was mapped or synced
+    if (is_write && file && shared && (old & (3ULL << 6)) == PT_AP_RO_EL0) {
+        vfs_dirty_page(vma->vm_file, file_offset);
         
-        memcpy(P2V(new_phys), P2V(old_phys), PAGE_SIZE);
+        flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+        if (*pte == old)
+            *pte = (old & ~(3ULL << 6)) | PT_AP_RW_EL0;
+        spinlock_release_irqrestore(&mm->page_table_lock, flags);
         
-        u64 entry = new_phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
-        entry |= (MT_NORMAL << 2);
-        entry |= PT_AP_RW_EL0;
+        tlb_flush_mm_page(mm, addr);
+        return 0;
+    }
+    
+    if (is_write && (old & PT_SW_COW)) {
+        u64 old_phys = old & 0x0000FFFFFFFFF000ULL;
+
+        flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+        if (*pte != old) {
+            spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            return 0;
+        }
+
+        // Everyone else already copied or exited, the frame is ours again.
+        // Page cache frames and the zero page always have to be copied.
+        if (!is_zero_page(old_phys) && pmm_get_ref(old_phys) == 1 &&
+            !(phys_to_page(old_phys)->flags & PG_PAGECACHE)) {
+            *pte = (old & ~(PT_SW_COW | (3ULL << 6))) | PT_AP_RW_EL0;
+            spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            tlb_flush_mm_page(mm, addr);
+            return 0;
+        }
+        spinlock_release_irqrestore(&mm->page_table_lock, flags);
+
+        u64 new_phys;
+        if (is_zero_page(old_phys)) {
+            new_phys = pmm_alloc_zeroed_frame();
+            if (!new_phys) return -1;
+        } else {
+            new_phys = pmm_alloc_frame();
+            if (!new_phys) return -1;
+            
+            memcpy(P2V(new_phys), P2V(old_phys), PAGE_SIZE);
+        }
         
-        if (!(vma->vm_flags & VMA_EXEC))
-            entry |= PT_UXN;
+        u64 entry = new_phys | vma_pte_attrs(vma);
         
+        flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+        if (*pte != old) {
+            // Someone else broke the COW first, our copy may be stale
+            spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            pmm_free_frame(new_phys);
+            return 0;
+        }
         *pte = entry;
+        spinlock_release_irqrestore(&mm->page_table_lock, flags);
         
-        pmm_free_frame(old_phys);
+        tlb_flush_mm_page(mm, addr);
         
-        asm volatile("tlbi vaale1is, %0" :: "r"(addr >> 12));
-        asm volatile("dsb ish");
-        asm volatile("isb");
+        // No CPU can still reach the old frame through this mm
+        put_user_frame(old_phys);
         
         return 0;
     }
     
+    // Already resolved by another thread
+    if (!is_write || (old & (3ULL << 6)) == PT_AP_RW_EL0)
+        return 0;
+    
     return -1;
 }
 
-// Expand stack downward
-int vma_expand_stack(mm_struct_t* mm, uintptr_t addr) {
+// Handle page fault in user space
+int vma_page_fault(mm_struct_t* mm, uintptr_t addr, bool is_write) {
     if (!mm) return -1;
     
-    vma_t* stack_vma = NULL;
-    vma_t* vma = mm->vma_list;
-    while (vma) {
-        if (vma->vm_flags & VMA_GROWSDN) {
-            stack_vma = vma;
+    rwsem_read_acquire(&mm->mmap_lock);
+    
+    vma_t* vma = vma_tree_find(mm, addr);
+    if (!vma) {
+        rwsem_read_release(&mm->mmap_lock);
+        
+        // Check if this could be stack expansion, it needs the lock for writing
+        if (addr < USER_STACK_TOP && addr >= USER_STACK_TOP - USER_STACK_SIZE * 2)
+            return vma_expand_stack(mm, addr);
+
+        return -1;  // No VMA covers this address
+    }
+    
+    int ret = handle_vma_fault(mm, vma, addr, is_write);
+    
+    rwsem_read_release(&mm->mmap_lock);
+    return ret;
+}
+
+// Writes the dirty pages of shared file mappings in [start, end) back to their
+// files. Their PTEs go read-only first, so a later write marks the page dirty again.
+// Returns -1 if part of the range isn't mapped.
+int vma_sync(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+    if (!mm || start >= end) return -1;
+    
+    rwsem_read_acquire(&mm->mmap_lock);
+    
+    u64* root = (u64*)P2V((uintptr_t)mm->page_table);
+    vma_t* vma = vma_tree_find_next(mm, start);
+    uintptr_t addr = start;
+    int ret = 0;
+    
+    while (addr < end) {
+        if (!vma || vma->vm_start > addr) {
+            ret = -1;  // Hole in the range
             break;
         }
+        
+        uintptr_t seg_end = vma->vm_end < end ? vma->vm_end : end;
+        
+        if (vma->vm_type == VMA_FILE && vma->vm_file && (vma->vm_flags & VMA_SHARED)) {
+            mmu_gather_t tlb;
+            tlb_gather_init(&tlb, mm, false);
+            
+            for (uintptr_t a = addr; a < seg_end; a += PAGE_SIZE) {
+                u64* pte = vmm_get_pte_from_table(root, a);
+                if (!pte) continue;
+                
+                u32 flags = spinlock_acquire_irqsave(&mm->page_table_lock);
+                if ((*pte & PT_VALID) && (*pte & (3ULL << 6)) == PT_AP_RW_EL0) {
+                    *pte = (*pte & ~(3ULL << 6)) | PT_AP_RO_EL0;
+                    tlb_gather_page(&tlb, a);
+                }
+                spinlock_release_irqrestore(&mm->page_table_lock, flags);
+            }
+            
+            tlb_gather_finish(&tlb);
+            
+            vfs_sync_range(vma->vm_file, vma->vm_pgoff + (addr - vma->vm_start), seg_end - addr);
+        }
+        
+        addr = seg_end;
         vma = vma->vm_next;
     }
     
-    if (!stack_vma) return -1;
+    rwsem_read_release(&mm->mmap_lock);
+    return ret;
+}
+
+// Sets the access pattern hint (0, VMA_SEQ_READ or VMA_RAND_READ) of [start, end),
+// splitting VMAs at the edges and merging them back where the hints agree.
+// Returns -1 if part of the range isn't mapped or a split failed.
+int vma_set_access_hint(mm_struct_t* mm, uintptr_t start, uintptr_t end, u32 hint) {
+    if (!mm || start >= end) return -1;
+    
+    rwsem_write_acquire(&mm->mmap_lock);
+    
+    vma_t* vma = vma_tree_find_next(mm, start);
+    uintptr_t addr = start;
+    int ret = 0;
+    
+    while (vma && vma->vm_start < end) {
+        if (vma->vm_start > addr) ret = -1;  // Hole in the range
+        
+        if ((vma->vm_flags & (VMA_SEQ_READ | VMA_RAND_READ)) != hint) {
+            if (vma->vm_start < start) {
+                vma = vma_split(mm, vma, start);
+                if (!vma) {
+                    ret = -1;
+                    break;
+                }
+            }
+            
+            if (vma->vm_end > end && !vma_split(mm, vma, end)) {
+                ret = -1;
+                break;
+            }
+            
+            vma->vm_flags = (vma->vm_flags & ~(VMA_SEQ_READ | VMA_RAND_READ)) | hint;
+            vma = vma_merge(mm, vma);
+        }
+        
+        addr = vma->vm_end;
+        vma = vma->vm_next;
+    }
+    
+    if (addr < end) ret = -1;
+    
+    rwsem_write_release(&mm->mmap_lock);
+    return ret;
+}
+
+// Faults in every page of [start, end) up front. Private writable mappings are
+// written to so they get their own frames, the rest is mapped for reading.
+// Returns -1 if part of the range isn't mapped or memory ran out.
+int vma_populate(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+    if (!mm || start >= end) return -1;
+    
+    rwsem_read_acquire(&mm->mmap_lock);
+    
+    u64* root = (u64*)P2V((uintptr_t)mm->page_table);
+    vma_t* vma = vma_tree_find_next(mm, start);
+    uintptr_t addr = start;
+    int ret = 0;
+    
+    while (vma && vma->vm_start < end) {
+        if (vma->vm_start > addr) ret = -1;  // Hole in the range
+        
+        uintptr_t a = vma->vm_start > start ? vma->vm_start : start;
+        uintptr_t seg_end = vma->vm_end < end ? vma->vm_end : end;
+        bool write = (vma->vm_flags & (VMA_WRITE | VMA_SHARED)) == VMA_WRITE;
+        
+        // Device VMAs are mapped in full when they are created
+        if (vma->vm_type == VMA_DEVICE) a = seg_end;
+        
+        for (; a < seg_end; a += PAGE_SIZE) {
+            u64* pte = vmm_get_pte_from_table(root, a);
+            if (pte && (*pte & PT_VALID) && (!write || (*pte & (3ULL << 6)) == PT_AP_RW_EL0))
+                continue;
+            
+            if (handle_vma_fault(mm, vma, a, write) < 0)
+                break;
+        }
+        
+        // Out of memory, the rest won't fare better
+        if (a < seg_end) {
+            ret = -1;
+            break;
+        }
+        
+        addr = vma->vm_end;
+        vma = vma->vm_next;
+    }
+    
+    if (addr < end) ret = -1;
+    
+    rwsem_read_release(&mm->mmap_lock);
+    return ret;
+}
+
+// Drops the pages of [start, end) but keeps the mapping. Anonymous memory reads
+// back as zeroes, file mappings refault from the page cache.
+// Returns -1 if part of the range isn't mapped.
+int vma_discard(mm_struct_t* mm, uintptr_t start, uintptr_t end) {
+    if (!mm || start >= end) return -1;
+    
+    rwsem_write_acquire(&mm->mmap_lock);
+    
+    mmu_gather_t tlb;
+    tlb_gather_init(&tlb, mm, false);
+    
+    vma_t* vma = vma_tree_find_next(mm, start);
+    uintptr_t addr = start;
+    int ret = 0;
+    
+    while (vma && vma->vm_start < end) {
+        if (vma->vm_start > addr) ret = -1;  // Hole in the range
+        
+        // Device pages can't be faulted back in, and shared anonymous pages have
+        // nothing behind them, a zap would lose the data and unshare the range
+        bool shared_anon = vma->vm_type == VMA_ANONYMOUS && (vma->vm_flags & VMA_SHARED);
+        if (vma->vm_type != VMA_DEVICE && !shared_anon) {
+            uintptr_t a = vma->vm_start > start ? vma->vm_start : start;
+            uintptr_t seg_end = vma->vm_end < end ? vma->vm_end : end;
+            
+            zap_range(mm, vma, a, seg_end, &tlb);
+        }
+        
+        addr = vma->vm_end;
+        vma = vma->vm_next;
+    }
+    
+    if (addr < end) ret = -1;
+    
+    tlb_gather_finish(&tlb);
+    
+    rwsem_write_release(&mm->mmap_lock);
+    return ret;
+}
+
+// copy_to_user for an address space that isn't the live one (exec builds the new
+// stack before switching to it). Writes through the linear map with one table walk
+// per page, the destination pages must already be mapped. Returns 0 or -1.
+int copy_to_mm(mm_struct_t* mm, uintptr_t user_dst, const void* kernel_src, size_t size) {
+    if (!mm || user_dst + size < user_dst || user_dst + size > USER_SPACE_END)
+        return -1;
+    
+    u64* root = (u64*)P2V((uintptr_t)mm->page_table);
+    const u8* src = kernel_src;
+    
+    while (size) {
+        u64* pte = vmm_get_pte_from_table(root, user_dst);
+        if (!pte || !(*pte & PT_VALID)) return -1;
+        
+        size_t offset = user_dst & (PAGE_SIZE - 1);
+        size_t chunk = PAGE_SIZE - offset;
+        if (chunk > size) chunk = size;
+        
+        memcpy((u8*)P2V(*pte & 0x0000FFFFFFFFF000ULL) + offset, src, chunk);
+        
+        user_dst += chunk;
+        src += chunk;
+        size -= chunk;
+    }
+    
+    return 0;
+}
+
+// Expand stack downward
+int vma_expand_stack(mm_struct_t* mm, uintptr_t addr) {
+    if (!mm) return -1;
     
     // Align address down to page boundary
     uintptr_t new_start = addr & ~(PAGE_SIZE - 1);
@@ -431,41 +926,130 @@ int vma_expand_stack(mm_struct_t* mm, uintptr_t addr) {
     if (new_start < USER_STACK_TOP - USER_STACK_SIZE * 2)
         return -1;
     
-    u32 flags = spinlock_acquire_irqsave(&vma_lock);
+    rwsem_write_acquire(&mm->mmap_lock);
+    
+    // The stack is the first VMA above the faulting address
+    vma_t* stack_vma = vma_tree_find_next(mm, addr);
+    if (!stack_vma || !(stack_vma->vm_flags & VMA_GROWSDN) ||
+        (stack_vma->vm_prev && stack_vma->vm_prev->vm_end > new_start)) {
+        rwsem_write_release(&mm->mmap_lock);
+        return -1;
+    }
     
-    // Expand the VMA
-    stack_vma->vm_start = new_start;
+    // Another thread may have grown it past us already
+    if (new_start < stack_vma->vm_start) {
+        stack_vma->vm_start = new_start;
+        vma_tree_update(mm, stack_vma);
+    }
     
-    spinlock_release_irqrestore(&vma_lock, flags);
+    rwsem_write_release(&mm->mmap_lock);
+    return 0;
+}
+
+// Copies the populated PTEs of vma from old_mm into new_mm, one table walk per
+// 2MB span. Private writable pages go read-only + COW on both sides.
+static int copy_range(mm_struct_t* new_mm, mm_struct_t* old_mm, vma_t* vma, mmu_gather_t* tlb) {
+    u64* old_l1 = (u64*)P2V((uintptr_t)old_mm->page_table);
+    u64* new_root = (u64*)P2V((uintptr_t)new_mm->page_table);
+    bool cow = !(vma->vm_flags & VMA_SHARED) && vma->vm_type != VMA_DEVICE;
+    uintptr_t addr = vma->vm_start;
+    uintptr_t end = vma->vm_end;
+
+    while (addr < end) {
+        uintptr_t l1_end = (addr | (L1_BLOCK_SIZE - 1)) + 1;
+        if (l1_end > end) l1_end = end;
+
+        u64 l1 = old_l1[(addr >> 30) & 0x1FF];
+        if (!(l1 & PT_VALID)) {
+            addr = l1_end;
+            continue;
+        }
+
+        u64* old_l2 = (u64*)P2V(l1 & 0x0000FFFFFFFFF000ULL);
+        while (addr < l1_end) {
+            uintptr_t l2_end = (addr | (L2_BLOCK_SIZE - 1)) + 1;
+            if (l2_end > l1_end) l2_end = l1_end;
+
+            u64 l2 = old_l2[(addr >> 21) & 0x1FF];
+            if (!(l2 & PT_VALID)) {
+                addr = l2_end;
+                continue;
+            }
+
+            u64* old_pte = (u64*)P2V(l2 & 0x0000FFFFFFFFF000ULL) + ((addr >> 12) & 0x1FF);
+            u64* new_pte = NULL;
+
+            for (; addr < l2_end; addr += PAGE_SIZE, old_pte++) {
+                u64 entry = *old_pte;
+                if (!(entry & PT_VALID)) {
+                    if (new_pte) new_pte++;
+                    continue;
+                }
+
+                // The child's L3 table is only created once something lives in this span
+                if (!new_pte) {
+                    new_pte = vmm_get_pte_from_table_alloc(new_root, addr);
+                    if (!new_pte) return -1;
+                }
+
+                if (cow && (entry & (3ULL << 6)) == PT_AP_RW_EL0) {
+                    entry &= ~(3ULL << 6);
+                    entry |= PT_AP_RO_EL0 | PT_SW_COW;
+                    *old_pte = entry;
+                    tlb_gather_page(tlb, addr);
+                }
+
+                *new_pte++ = entry;
+
+                if (vma->vm_type != VMA_DEVICE && !is_zero_page(entry & 0x0000FFFFFFFFF000ULL)) {
+                    page_t* page = phys_to_page(entry & 0x0000FFFFFFFFF000ULL);
+                    if (page->flags & PG_PAGECACHE)
+                        page_map_inc(page);
+                    
+                    pmm_inc_ref(entry & 0x0000FFFFFFFFF000ULL);
+                }
+            }
+        }
+    }
+
     return 0;
 }
 
 mm_struct_t* mm_duplicate(mm_struct_t* old_mm) {
     if (!old_mm) return NULL;
 
-    mm_struct_t* new_mm = (mm_struct_t*)kmalloc(sizeof(mm_struct_t));
+    mm_struct_t* new_mm = (mm_struct_t*)kmem_cache_alloc(mm_cache);
     if (!new_mm) return NULL;
     memset(new_mm, 0, sizeof(mm_struct_t));
 
-    u64 pt_phys = pmm_alloc_frame();
+    u64 pt_phys = pmm_alloc_zeroed_frame();
     if (!pt_phys) {
-        kfree(new_mm);
+        kmem_cache_free(mm_cache, new_mm);
         return NULL;
     }
 
-    memset(P2V(pt_phys), 0, PAGE_SIZE);
-
     new_mm->page_table = (u64*)pt_phys;
+    new_mm->ttbr_users = 1;
     new_mm->heap_start = old_mm->heap_start;
     new_mm->heap_end   = old_mm->heap_end;
     new_mm->stack_start = old_mm->stack_start;
     new_mm->mmap_base  = old_mm->mmap_base;
+    rwsem_init(&new_mm->mmap_lock);
+    new_mm->page_table_lock = 0;
+
+    // Sibling threads must not fault while the parent PTEs turn COW
+    rwsem_write_acquire(&old_mm->mmap_lock);
+
+    mmu_gather_t tlb;
+    tlb_gather_init(&tlb, old_mm, false);
 
     // Iterates through parent's VMAs and clone them
     vma_t* old_vma = old_mm->vma_list;
     while (old_vma) {
         vma_t* new_vma = vma_create(old_vma->vm_start, old_vma->vm_end, old_vma->vm_flags, old_vma->vm_type);
         if (!new_vma) {
+            tlb_gather_finish(&tlb);
+            rwsem_write_release(&old_mm->mmap_lock);
             mm_destroy(new_mm);
             return NULL; 
         }
@@ -473,38 +1057,24 @@ mm_struct_t* mm_duplicate(mm_struct_t* old_mm) {
         // Clone metadata
         new_vma->vm_file = old_vma->vm_file;
         new_vma->vm_pgoff = old_vma->vm_pgoff;
+        vfs_retain(new_vma->vm_file);
         
-        vma_insert(new_mm, new_vma);
-
-        for (uintptr_t addr = old_vma->vm_start; addr < old_vma->vm_end; addr += PAGE_SIZE) {
-            u64* old_pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)old_mm->page_table), addr);
+        // new_mm isn't visible to anyone yet
+        vma_insert_locked(new_mm, new_vma);
 
-            if (old_pte && (*old_pte & PT_VALID)) {
-                u64* new_pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)new_mm->page_table), addr);
-                if (!new_pte) continue;
-
-                u64 phys = *old_pte & 0x0000FFFFFFFFF000ULL;
-
-                if (!(old_vma->vm_flags & VMA_SHARED) && 
-                   ((*old_pte & PT_AP_RW_EL0) || (*old_pte & PT_AP_RW_EL1))) {
-                    
-                    // Set Read-Only and COW flag in parent
-                    *old_pte &= ~(3ULL << 6); // Clear AP bits
-                    *old_pte |= PT_AP_RO_EL0; // Set to User Read-Only
-                    *old_pte |= PT_SW_COW;    // Set our software COW marker
-                }
-
-                *new_pte = *old_pte;
-                
-                pmm_inc_ref(phys);
-            }
+        if (copy_range(new_mm, old_mm, old_vma, &tlb) < 0) {
+            tlb_gather_finish(&tlb);
+            rwsem_write_release(&old_mm->mmap_lock);
+            mm_destroy(new_mm);
+            return NULL;
         }
+
         old_vma = old_vma->vm_next;
     }
 
-    asm volatile("tlbi vmalle1is"); 
-    asm volatile("dsb ish");
-    asm volatile("isb");
+    // Parent PTEs went read-only for COW
+    tlb_gather_finish(&tlb);
+    rwsem_write_release(&old_mm->mmap_lock);
 
     return new_mm;
 }
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include <vma.h>
+
+// VMAs sit in an AVL tree keyed by vm_start, alongside the sorted vm_next/vm_prev
+// list used for ordered walks. Every node caches the hole in front of it (vm_gap)
+// and the largest hole in its subtree (vm_subtree_gap), so the free area search
+// only descends into subtrees that have room.
+
+static inline int node_height(vma_t* v) {
+    return v ? v->vm_height : 0;
+}
+
+static inline uintptr_t node_subtree_gap(vma_t* v) {
+    return v ? v->vm_subtree_gap : 0;
+}
+
+static void augment(vma_t* v) {
+    int hl = node_height(v->vm_left);
+    int hr = node_height(v->vm_right);
+    v->vm_height = 1 + (hl > hr ? hl : hr);
+
+    uintptr_t gap = v->vm_gap;
+    if (node_subtree_gap(v->vm_left) > gap) gap = node_subtree_gap(v->vm_left);
+    if (node_subtree_gap(v->vm_right) > gap) gap = node_subtree_gap(v->vm_right);
+    v->vm_subtree_gap = gap;
+}
+
+static void set_gap(vma_t* v) {
+    v->vm_gap = v->vm_start - (v->vm_prev ? v->vm_prev->vm_end : USER_SPACE_START);
+}
+
+static void replace_child(mm_struct_t* mm, vma_t* parent, vma_t* old, vma_t* new) {
+    if (!parent) mm->vma_root = new;
+    else if (parent->vm_left == old) parent->vm_left = new;
+    else parent->vm_right = new;
+
+    if (new) new->vm_parent = parent;
+}
+
+static vma_t* rotate_left(mm_struct_t* mm, vma_t* x) {
+    vma_t* y = x->vm_right;
+
+    x->vm_right = y->vm_left;
+    if (y->vm_left) y->vm_left->vm_parent = x;
+
+    replace_child(mm, x->vm_parent, x, y);
+    y->vm_left = x;
+    x->vm_parent = y;
+
+    augment(x);
+    augment(y);
+    return y;
+}
+
+static vma_t* rotate_right(mm_struct_t* mm, vma_t* x) {
+    vma_t* y = x->vm_left;
+
+    x->vm_left = y->vm_right;
+    if (y->vm_right) y->vm_right->vm_parent = x;
+
+    replace_child(mm, x->vm_parent, x, y);
+    y->vm_right = x;
+    x->vm_parent = y;
+
+    augment(x);
+    augment(y);
+    return y;
+}
+
+// Restores balance and the cached values from v up to the root
+static void rebalance(mm_struct_t* mm, vma_t* v) {
+    while (v) {
+        augment(v);
+        int balance = node_height(v->vm_left) - node_height(v->vm_right);
+
+        if (balance > 1) {
+            if (node_height(v->vm_left->vm_left) < node_height(v->vm_left->vm_right))
+                rotate_left(mm, v->vm_left);
+            v = rotate_right(mm, v);
+        } else if (balance < -1) {
+            if (node_height(v->vm_right->vm_right) < node_height(v->vm_right->vm_left))
+                rotate_right(mm, v->vm_right);
+            v = rotate_left(mm, v);
+        }
+
+        v = v->vm_parent;
+    }
+}
+
+// Links vma into the tree and the list, the caller has checked for overlaps
+void vma_tree_insert(mm_struct_t* mm, vma_t* vma) {
+    vma_t* parent = NULL;
+    vma_t* prev = NULL;
+    vma_t** link = &mm->vma_root;
+
+    while (*link) {
+        parent = *link;
+        if (vma->vm_start < parent->vm_start) {
+            link = &parent->vm_left;
+        } else {
+            prev = parent;
+            link = &parent->vm_right;
+        }
+    }
+
+    vma->vm_left = NULL;
+    vma->vm_right = NULL;
+    vma->vm_parent = parent;
+    *link = vma;
+
+    vma->vm_prev = prev;
+    vma->vm_next = prev ? prev->vm_next : mm->vma_list;
+    if (prev) prev->vm_next = vma;
+    else mm->vma_list = vma;
+    if (vma->vm_next) vma->vm_next->vm_prev = vma;
+
+    set_gap(vma);
+    rebalance(mm, vma);
+
+    if (vma->vm_next) {
+        set_gap(vma->vm_next);
+        rebalance(mm, vma->vm_next);
+    }
+}
+
+void vma_tree_remove(mm_struct_t* mm, vma_t* vma) {
+    vma_t* next = vma->vm_next;
+    vma_t* fix;
+
+    if (vma->vm_prev) vma->vm_prev->vm_next = next;
+    else mm->vma_list = next;
+    if (next) next->vm_prev = vma->vm_prev;
+
+    if (!vma->vm_left || !vma->vm_right) {
+        fix = vma->vm_parent;
+        replace_child(mm, vma->vm_parent, vma, vma->vm_left ? vma->vm_left : vma->vm_right);
+    } else {
+        // Two children: the in-order successor, which is next, takes its place
+        vma_t* succ = next;
+
+        if (succ->vm_parent != vma) {
+            fix = succ->vm_parent;
+            replace_child(mm, succ->vm_parent, succ, succ->vm_right);
+            succ->vm_right = vma->vm_right;
+            succ->vm_right->vm_parent = succ;
+        } else {
+            fix = succ;
+        }
+
+        succ->vm_left = vma->vm_left;
+        succ->vm_left->vm_parent = succ;
+        replace_child(mm, vma->vm_parent, vma, succ);
+    }
+
+    rebalance(mm, fix);
+
+    if (next) {
+        set_gap(next);
+        rebalance(mm, next);
+    }
+
+    vma->vm_next = NULL;
+    vma->vm_prev = NULL;
+}
+
+// Refreshes the cached gaps after vm_start or vm_end moved without crossing a neighbour
+void vma_tree_update(mm_struct_t* mm, vma_t* vma) {
+    set_gap(vma);
+    rebalance(mm, vma);
+
+    if (vma->vm_next) {
+        set_gap(vma->vm_next);
+        rebalance(mm, vma->vm_next);
+    }
+}
+
+// VMA containing addr
+vma_t* vma_tree_find(mm_struct_t* mm, uintptr_t addr) {
+    vma_t* v = mm->vma_root;
+
+    while (v) {
+        if (addr < v->vm_start) v = v->vm_left;
+        else if (addr >= v->vm_end) v = v->vm_right;
+        else return v;
+    }
+
+    return NULL;
+}
+
+// Lowest VMA ending above addr, the first one a range starting at addr can overlap
+vma_t* vma_tree_find_next(mm_struct_t* mm, uintptr_t addr) {
+    vma_t* v = mm->vma_root;
+    vma_t* found = NULL;
+
+    while (v) {
+        if (v->vm_end > addr) {
+            found = v;
+            v = v->vm_left;
+        } else {
+            v = v->vm_right;
+        }
+    }
+
+    return found;
+}
+
+// Lowest VMA whose front hole fits length bytes at or above low
+static vma_t* gap_search(vma_t* v, uintptr_t low, size_t length) {
+    if (!v || v->vm_subtree_gap < length) return NULL;
+
+    // Nodes starting below low + length, and their left subtrees, can't hold the hole
+    if (v->vm_start >= low + length) {
+        vma_t* found = gap_search(v->vm_left, low, length);
+        if (found) return found;
+
+        uintptr_t hole = v->vm_start - v->vm_gap;
+        if (hole < low) hole = low;
+        if (v->vm_start - hole >= length) return v;
+    }
+
+    return gap_search(v->vm_right, low, length);
+}
+
+// First free range of length bytes at or above low, 0 if the address space is full
+uintptr_t vma_tree_unmapped_area(mm_struct_t* mm, uintptr_t low, size_t length) {
+    vma_t* v = gap_search(mm->vma_root, low, length);
+    if (v) {
+        uintptr_t hole = v->vm_start - v->vm_gap;
+        return hole > low ? hole : low;
+    }
+
+    // Past the last VMA
+    uintptr_t addr = low;
+    v = mm->vma_root;
+    while (v && v->vm_right) v = v->vm_right;
+    if (v && v->vm_end > addr) addr = v->vm_end;
+
+    if (addr + length > USER_SPACE_END || addr + length < addr) return 0;
+    return addr;
+}
@@ -0,0 +1,133 @@
+#include <vmalloc.h>
+#include <vmm.h>
+#include <pmm.h>
+#include <heap.h>
+#include <spinlock.h>
+#include <kio.h>
+
+// Areas are kept sorted by address, each one followed by an unmapped guard page
+typedef struct vmap_area {
+    uintptr_t start;
+    size_t size;                // Mapped bytes, guard page excluded
+    struct vmap_area *next;
+} vmap_area_t;
+
+static vmap_area_t *vmap_areas = NULL;
+static spinlock_t vmalloc_lock = 0;
+static kmem_cache_t *vmap_area_cache = NULL;
+
+void vmalloc_init() {
+    vmap_area_cache = kmem_cache_create("vmap_area_t", sizeof(vmap_area_t), 0, NULL);
+}
+
+// Finds the first hole that fits the area plus its guard page
+static bool vmap_reserve(vmap_area_t *area) {
+    uintptr_t addr = VMALLOC_START;
+    vmap_area_t *prev = NULL;
+    vmap_area_t *curr = vmap_areas;
+
+    while (curr) {
+        if (addr + area->size + PAGE_SIZE <= curr->start) break;
+
+        addr = curr->start + curr->size + PAGE_SIZE;
+        prev = curr;
+        curr = curr->next;
+    }
+
+    if (addr + area->size + PAGE_SIZE > VMALLOC_END) return false;
+
+    area->start = addr;
+    area->next = curr;
+    if (prev) prev->next = area;
+    else vmap_areas = area;
+
+    return true;
+}
+
+static vmap_area_t* vmap_remove(uintptr_t addr) {
+    u32 flags = spinlock_acquire_irqsave(&vmalloc_lock);
+
+    vmap_area_t *prev = NULL;
+    vmap_area_t *curr = vmap_areas;
+    while (curr && curr->start != addr) {
+        prev = curr;
+        curr = curr->next;
+    }
+
+    if (curr) {
+        if (prev) prev->next = curr->next;
+        else vmap_areas = curr->next;
+    }
+
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+    return curr;
+}
+
+static void vmap_unmap(uintptr_t start, size_t size) {
+    for (uintptr_t addr = start; addr < start + size; addr += PAGE_SIZE) {
+        uintptr_t phys = vmm_unmap_page(addr);
+        if (phys) pmm_free_frame(phys);
+    }
+}
+
+void* vmalloc(size_t size) {
+    if (size == 0) return NULL;
+
+    vmap_area_t *area = (vmap_area_t*)kmem_cache_alloc(vmap_area_cache);
+    if (!area) return NULL;
+
+    area->size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    u32 flags = spinlock_acquire_irqsave(&vmalloc_lock);
+    bool reserved = vmap_reserve(area);
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+
+    if (!reserved) {
+        kprintf("[ [CVMALLOC [W] Out of address space for %d bytes\n", size);
+        kmem_cache_free(vmap_area_cache, area);
+        return NULL;
+    }
+
+    for (size_t off = 0; off < area->size; off += PAGE_SIZE) {
+        uintptr_t phys = pmm_alloc_frame();
+        if (!phys) {
+            vmap_unmap(area->start, off);
+            vmap_remove(area->start);
+            kmem_cache_free(vmap_area_cache, area);
+            return NULL;
+        }
+
+        vmm_map_page(area->start + off, phys, VM_WRITABLE | VM_NO_EXEC);
+    }
+
+    return (void*)area->start;
+}
+
+// Mapped bytes of the area starting at ptr, 0 if there is none
+size_t vmalloc_size(const void* ptr) {
+    size_t size = 0;
+    u32 flags = spinlock_acquire_irqsave(&vmalloc_lock);
+
+    for (vmap_area_t *curr = vmap_areas; curr; curr = curr->next) {
+        if (curr->start == (uintptr_t)ptr) {
+            size = curr->size;
+            break;
+        }
+    }
+
+    spinlock_release_irqrestore(&vmalloc_lock, flags);
+    return size;
+}
+
+void vfree(void* ptr) {
+    if (!ptr) return;
+
+    vmap_area_t *area = vmap_remove((uintptr_t)ptr);
+    if (!area) {
+        kprintf("[ [CVMALLOC [W] vfree of unknown area %p\n", ptr);
+        return;
+    }
+
+    vmap_unmap(area->start, area->size);
+    kmem_cache_free(vmap_area_cache, area);
+}
@@ -48,7 +48,15 @@ static inline void write_ttbr0(u64 val){ asm volatile("msr ttbr0_el1, %0" :: "r"
 static inline void write_ttbr1(u64 val){ asm volatile("msr ttbr1_el1, %0" :: "r"(val) : "memory"); }
 static inline void write_sctlr(u64 val){ asm volatile("msr sctlr_el1, %0" :: "r"(val) : "memory"); }
 
+// Valid descriptor that maps memory itself instead of pointing to a table
+static inline bool is_block(u64 entry) {
+    return (entry & (PT_VALID | PT_TABLE)) == PT_VALID;
+}
+
 static u64* get_next_table(u64* table, u64 idx) {
+    // Linear map blocks are never split, the running kernel lives in them
+    if (is_block(table[idx])) return NULL;
+
     if (table[idx] & PT_VALID) {
         // For 4KB granule, output address is bits [47:12]
         u64 phys = table[idx] & 0x0000FFFFFFFFF000ULL;
@@ -56,12 +64,10 @@ static u64* get_next_table(u64* table, u64 idx) {
     }
 
     // Invalid
-    u64 new_table_phys = pmm_alloc_frame();
+    u64 new_table_phys = pmm_alloc_zeroed_frame();
     if (!new_table_phys) return NULL;   // Out of memory
     
     u64* new_table_virt = (u64*)safe_P2V(new_table_phys);
-
-    memset((void*)new_table_virt, 0, PAGE_SIZE);
     
     table[idx] = new_table_phys | PT_TABLE | PT_VALID;
 
@@ -75,10 +81,10 @@ u64* vmm_get_pte_from_table(u64* page_table, uintptr_t virt) {
 
     if (!page_table) return NULL;
 
-    if (!(page_table[l1_idx] & PT_VALID)) return NULL;
+    if (!(page_table[l1_idx] & PT_VALID) || is_block(page_table[l1_idx])) return NULL;
     u64* l2_table = (u64*)P2V(page_table[l1_idx] & 0x0000FFFFFFFFF000ULL);
 
-    if (!(l2_table[l2_idx] & PT_VALID)) return NULL;
+    if (!(l2_table[l2_idx] & PT_VALID) || is_block(l2_table[l2_idx])) return NULL;
     u64* l3_table = (u64*)P2V(l2_table[l2_idx] & 0x0000FFFFFFFFF000ULL);
 
     return &l3_table[l3_idx];
@@ -93,18 +99,16 @@ u64* vmm_get_pte_from_table_alloc(u64* page_table, uintptr_t virt) {
 
     // Allocate L2 if needed
     if (!(page_table[l1_idx] & PT_VALID)) {
-        u64 l2_phys = pmm_alloc_frame();
+        u64 l2_phys = pmm_alloc_zeroed_frame();
         if (!l2_phys) return NULL;
-        memset(P2V(l2_phys), 0, PAGE_SIZE);
         page_table[l1_idx] = l2_phys | PT_TABLE | PT_VALID;
     }
     u64* l2_table = (u64*)P2V(page_table[l1_idx] & 0x0000FFFFFFFFF000ULL);
 
     // Allocate L3 if needed
     if (!(l2_table[l2_idx] & PT_VALID)) {
-        u64 l3_phys = pmm_alloc_frame();
+        u64 l3_phys = pmm_alloc_zeroed_frame();
         if (!l3_phys) return NULL;
-        memset(P2V(l3_phys), 0, PAGE_SIZE);
         l2_table[l2_idx] = l3_phys | PT_TABLE | PT_VALID;
     }
     u64* l3_table = (u64*)P2V(l2_table[l2_idx] & 0x0000FFFFFFFFF000ULL);
@@ -127,50 +131,10 @@ static u64* vmm_get_pte(uintptr_t virt, bool allocate) {
 
     return &l3_table[l3_idx];
 }
-#endif
-
-void dcache_clean_poc(void *addr, size_t size) {
-#ifdef ARM
-    uintptr_t start = (uintptr_t)addr & ~(64 - 1);
-    uintptr_t end = (uintptr_t)addr + size;
-    
-    asm volatile("dsb sy" ::: "memory");
-    while (start < end) {
-        asm volatile("dc cvac, %0" :: "r"(start) : "memory");
-        start += 64;
-    }
-    asm volatile("dsb sy" ::: "memory");
-    asm volatile("isb" ::: "memory");
-#endif
-}
-
-// Maps a single 4KB page in kernel space
-void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags) {
-    mutex_acquire(&vmm_lock);
-#ifdef ARM
-    // Indices for 39-bit Virtual Address Space
-    // L1: bits [38:30]
-    // L2: bits [29:21]
-    // L3: bits [20:12]
-    
-    u64 l1_idx = (virt >> 30) & 0x1FF;
-    u64 l2_idx = (virt >> 21) & 0x1FF;
-    u64 l3_idx = (virt >> 12) & 0x1FF;
-
-    u64* l2_table = get_next_table(root_table, l1_idx);
-    if (!l2_table) {
-        kprintf("[ [CVMM [W] Failed to allocate L2 table for 0x%llx\n", virt);
-        return;
-    }
-
-    // Walk L2 -> L3
-    u64* l3_table = get_next_table(l2_table, l2_idx);
-    if (!l3_table) {
-        kprintf("[ [CVMM [W] Failed to allocate L3 table for 0x%llx\n", virt);
-        return;
-    }
 
-    u64 entry = phys | PT_PAGE | PT_VALID | PT_AF | PT_SH_INNER;
+// Descriptor bits for VM_* flags, without the output address and the page/block bit
+static u64 vmm_attrs(u64 flags) {
+    u64 entry = PT_VALID | PT_AF | PT_SH_INNER;
     
     if (flags & VM_DEVICE) {
         entry |= PT_PXN | PT_UXN;
@@ -179,6 +143,7 @@ void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags) {
     }
 
     if (flags & VM_USER) {
+        entry |= PT_NG | PT_PXN;    // The kernel never runs user code
         if (flags & VM_NO_EXEC) entry |= PT_UXN;
         
         if (flags & PT_SW_COW) {
@@ -191,6 +156,7 @@ void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags) {
         }
     } else {
         entry |= PT_UXN;
+        if (flags & VM_NO_EXEC) entry |= PT_PXN;
         if (flags & VM_WRITABLE) {
             entry |= PT_AP_RW_EL1;
         } else {
@@ -198,29 +164,217 @@ void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags) {
         }
     }
 
-    l3_table[l3_idx] = entry;
+    return entry;
+}
+
 #endif
-    mutex_release(&vmm_lock);
+
+void dcache_clean_poc(void *addr, size_t size) {
+#ifdef ARM
+    uintptr_t start = (uintptr_t)addr & ~(64 - 1);
+    uintptr_t end = (uintptr_t)addr + size;
+    
+    asm volatile("dsb sy" ::: "memory");
+    while (start < end) {
+        asm volatile("dc cvac, %0" :: "r"(start) : "memory");
+        start += 64;
+    }
+    asm volatile("dsb sy" ::: "memory");
+    asm volatile("isb" ::: "memory");
+#endif
+}
+
+#ifdef ARM
+// Fills L3 entries for [virt, virt + size), walking L1/L2 once per 2MB span
+static int map_range(u64* page_table, uintptr_t virt, uintptr_t phys, size_t size, u64 attrs) {
+    uintptr_t end = virt + size;
+
+    while (virt < end) {
+        u64* l2_table = get_next_table(page_table, (virt >> 30) & 0x1FF);
+        if (!l2_table) {
+            kprintf("[ [CVMM [W] Failed to allocate L2 table for 0x%llx\n", virt);
+            return -1;
+        }
+
+        u64* l3_table = get_next_table(l2_table, (virt >> 21) & 0x1FF);
+        if (!l3_table) {
+            kprintf("[ [CVMM [W] Failed to allocate L3 table for 0x%llx\n", virt);
+            return -1;
+        }
+
+        uintptr_t span_end = (virt | (L2_BLOCK_SIZE - 1)) + 1;
+        if (span_end > end || span_end == 0) span_end = end;
+
+        u64* pte = &l3_table[(virt >> 12) & 0x1FF];
+        for (; virt < span_end; virt += PAGE_SIZE, phys += PAGE_SIZE)
+            *pte++ = phys | PT_PAGE | attrs;
+    }
+
+    return 0;
 }
 
-// Maps a contiguous range of physical memory
+// Clears L3 entries for [virt, virt + size), skipping spans with no table.
+// Frames are not freed and the TLB is left to the caller.
+static size_t unmap_range(u64* page_table, uintptr_t virt, size_t size) {
+    uintptr_t end = virt + size;
+    size_t cleared = 0;
+
+    while (virt < end) {
+        u64 l1 = page_table[(virt >> 30) & 0x1FF];
+        if (!(l1 & PT_VALID) || is_block(l1)) {
+            virt = (virt | (L1_BLOCK_SIZE - 1)) + 1;
+            if (!virt) break;
+            continue;
+        }
+
+        u64* l2_table = (u64*)safe_P2V(l1 & 0x0000FFFFFFFFF000ULL);
+        u64 l2 = l2_table[(virt >> 21) & 0x1FF];
+
+        uintptr_t span_end = (virt | (L2_BLOCK_SIZE - 1)) + 1;
+        if (span_end > end || span_end == 0) span_end = end;
+
+        if (!(l2 & PT_VALID) || is_block(l2)) {
+            virt = span_end;
+            continue;
+        }
+
+        u64* l3_table = (u64*)safe_P2V(l2 & 0x0000FFFFFFFFF000ULL);
+        u64* pte = &l3_table[(virt >> 12) & 0x1FF];
+        for (; virt < span_end; virt += PAGE_SIZE, pte++) {
+            if (*pte & PT_VALID) {
+                *pte = 0;
+                cleared++;
+            }
+        }
+    }
+
+    return cleared;
+}
+
+static void kernel_tlb_flush_range(uintptr_t virt, size_t size) {
+    dsb();
+    if (size / PAGE_SIZE > 64) {
+        asm volatile("tlbi vmalle1is" ::: "memory");
+    } else {
+        for (uintptr_t addr = virt; addr < virt + size; addr += PAGE_SIZE)
+            asm volatile("tlbi vaae1is, %0" :: "r"(addr >> 12) : "memory");
+    }
+    dsb();
+    isb();
+}
+#endif
+
+// Maps a physically contiguous range into any page table, 4KB pages.
+// User tables are not covered by vmm_lock, the caller serializes.
+int vmm_map_range(u64* page_table, uintptr_t virt, uintptr_t phys, size_t size, u64 flags) {
+#ifdef ARM
+    return map_range(page_table, virt, phys, size, vmm_attrs(flags));
+#else
+    return -1;
+#endif
+}
+
+// Clears a range of any page table, returns how many pages were mapped
+size_t vmm_unmap_range(u64* page_table, uintptr_t virt, size_t size) {
+#ifdef ARM
+    return unmap_range(page_table, virt, size);
+#else
+    return 0;
+#endif
+}
+
+// Maps a single 4KB page in kernel space
+void vmm_map_page(uintptr_t virt, uintptr_t phys, u64 flags) {
+    vmm_map_region(virt, phys, PAGE_SIZE, flags);
+}
+
+// Maps a contiguous range of physical memory in kernel space
 void vmm_map_region(uintptr_t virt, uintptr_t phys, size_t size, u64 flags) {
-    size_t mapped = 0;
-    while (mapped < size) {
-        vmm_map_page(virt + mapped, phys + mapped, flags);
-        mapped += PAGE_SIZE;
+    mutex_acquire(&vmm_lock);
+#ifdef ARM
+    map_range(root_table, virt, phys, size, vmm_attrs(flags));
+#endif
+    mutex_release(&vmm_lock);
+}
+
+// Removes kernel mappings in the range and flushes them from every TLB
+void vmm_unmap_region(uintptr_t virt, size_t size) {
+    mutex_acquire(&vmm_lock);
+#ifdef ARM
+    if (unmap_range(root_table, virt, size))
+        kernel_tlb_flush_range(virt, size);
+#endif
+    mutex_release(&vmm_lock);
+}
+
+// Removes a kernel page mapping, returns the physical address it pointed to or 0
+uintptr_t vmm_unmap_page(uintptr_t virt) {
+    uintptr_t phys = 0;
+
+    mutex_acquire(&vmm_lock);
+#ifdef ARM
+    u64* pte = vmm_get_pte_from_table(root_table, virt);
+    if (pte && (*pte & PT_VALID)) {
+        phys = *pte & 0x0000FFFFFFFFF000ULL;
+        *pte = 0;
+        kernel_tlb_flush_range(virt, PAGE_SIZE);
+    }
+#endif
+    mutex_release(&vmm_lock);
+
+    return phys;
+}
+
+// Maps a physically contiguous range with the largest descriptors that fit:
+// 1GB L1 blocks, 2MB L2 blocks, then 4KB pages. Meant for the boot linear map.
+void vmm_map_linear(uintptr_t virt, uintptr_t phys, size_t size, u64 flags) {
+#ifdef ARM
+    u64 attrs = vmm_attrs(flags);
+
+    while (size >= PAGE_SIZE) {
+        u64 l1_idx = (virt >> 30) & 0x1FF;
+        u64 l2_idx = (virt >> 21) & 0x1FF;
+        u64 aligned = virt | phys;
+        u64 step = PAGE_SIZE;
+
+        if (!(aligned & (L1_BLOCK_SIZE - 1)) && size >= L1_BLOCK_SIZE && !(root_table[l1_idx] & PT_VALID)) {
+            root_table[l1_idx] = phys | attrs;
+            step = L1_BLOCK_SIZE;
+        } else {
+            u64* l2_table = get_next_table(root_table, l1_idx);
+            if (!l2_table) {
+                kprintf("[ [CVMM [W] Failed to allocate L2 table for 0x%llx\n", virt);
+                return;
+            }
+
+            if (!(aligned & (L2_BLOCK_SIZE - 1)) && size >= L2_BLOCK_SIZE && !(l2_table[l2_idx] & PT_VALID)) {
+                l2_table[l2_idx] = phys | attrs;
+                step = L2_BLOCK_SIZE;
+            } else {
+                u64* l3_table = get_next_table(l2_table, l2_idx);
+                if (!l3_table) {
+                    kprintf("[ [CVMM [W] Failed to allocate L3 table for 0x%llx\n", virt);
+                    return;
+                }
+
+                l3_table[(virt >> 12) & 0x1FF] = phys | PT_PAGE | attrs;
+            }
+        }
+
+        virt += step;
+        phys += step;
+        size -= step;
     }
+#endif
 }
 
-extern u64 _kernel_end;
 extern u8 *uart;
 extern u64 *gic;
 extern u64 *fwcfg;
 extern u64 *virtio;
 
 void init_vmm() {
-    root_phys = pmm_alloc_frame();
-    memset((void*)root_phys, 0, PAGE_SIZE);
+    root_phys = pmm_alloc_zeroed_frame();
 
     root_table = (u64*)root_phys;
 
@@ -236,17 +390,18 @@ void init_vmm() {
     // TG0=4KB, TG1=4KB
     // IPS=40-bit PA
     u64 tcr = (25UL << 0) | (0UL << 14) | (2UL << 32) | (25UL << 16) | (2UL << 30);
-    write_tcr(tcr);
-#endif
 
-    // Kernel map
-    u64 kernel_size = (u64)&_kernel_end - 0x40000000;
-    vmm_map_region(0x40000000, 0x40000000, kernel_size, VM_WRITABLE);
+    // AS=1: 16-bit ASIDs when the CPU has them
+    u64 mmfr0;
+    asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    if (((mmfr0 >> 4) & 0xF) == 2) tcr |= (1UL << 36);
 
-    vmm_map_region(PHYS_OFFSET + PHY_RAM_BASE, PHY_RAM_BASE, phy_ram_size, VM_WRITABLE);
+    write_tcr(tcr);
+#endif
 
-    // Heap map
-    vmm_map_region(0x50000000, 0x50000000, 8 * 1024 * 1024, VM_WRITABLE);
+    // Linear map of RAM. TTBR0 and TTBR1 share root_table and both index it with
+    // VA[38:30], so this also identity maps the kernel image and the boot heap.
+    vmm_map_linear(PHYS_OFFSET + PHY_RAM_BASE, PHY_RAM_BASE, phy_ram_size, VM_WRITABLE);
 
 #ifdef ARM
     // MMIO Peripherals map
@@ -297,6 +452,12 @@ int vmm_handle_page_fault(uintptr_t virt, bool is_write) {
         return vma_page_fault(current_task->proc->mm, virt, is_write);
     }
     
+    // vmalloc areas are mapped up front, so this is a guard page or a freed area
+    if (virt >= VMALLOC_START && virt < VMALLOC_END) {
+        kprintf("[ [CVMM [W] Kernel fault in vmalloc area at 0x%llx\n", virt);
+        return -1;
+    }
+
     // Kernel space fault - use old mechanism
     u64* pte = vmm_get_pte(virt, false);
 
@@ -308,14 +469,12 @@ int vmm_handle_page_fault(uintptr_t virt, bool is_write) {
     // Case 1: demand paging
     // Page is not valid (Bit 0 is 0)
     if (!(entry & PT_VALID)) {
-        u64 new_frame = pmm_alloc_frame();
+        u64 new_frame = pmm_alloc_zeroed_frame();
         if (!new_frame) {
             kprintf("[ [CVMM [W] OOM during demand paging\n");
             return -1;
         }
 
-        memset((void*)P2V(new_frame), 0, PAGE_SIZE);
-
         u64 new_entry = new_frame | PT_PAGE | PT_VALID | PT_AF | PT_SH_INNER;
         new_entry |= (MT_NORMAL << 2);  // Normal memory
         new_entry |= PT_AP_RW_EL1;      // Kernel read/write
@@ -9,49 +9,13 @@
 #include <pmm.h>
 #include <vmm.h>
 #include <file.h>
+#include <asid.h>
 
 extern void enter_usermode(u64 entry, u64 sp, u64 kernel_sp);
 
-static inline u64 get_phys_from_pte(u64 *pte) {
-    return (*pte) & 0x0000FFFFFFFFF000ULL;
-}
-
-static int ensure_user_page(mm_struct_t* mm, u64 va) {
-    u64 page_base = va & ~(PAGE_SIZE - 1);
-    u64 *pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)mm->page_table), page_base);
-
-    if (!pte) return -1;
-    if (!(*pte & PT_VALID)) {
-        u64 phys = pmm_alloc_frame();
-        if (!phys) return -1;
-        memset(P2V(phys), 0, PAGE_SIZE);
-        u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
-        entry |= (MT_NORMAL << 2);
-        entry |= PT_AP_RW_EL0;
-        entry |= PT_UXN;
-        *pte = entry;
-    }
-
-    return 0;
-}
-
 static u64 copy_string_to_user(mm_struct_t* mm, const char* src, u64 dest) {
-    u64 len = strlen(src) + 1;
-
-    for (u64 i = 0; i < len; i++) {
-        u64 addr = dest + i;
-
-        if (ensure_user_page(mm, addr) != 0)
-            return 0;
-
-        u64 *pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), addr & ~(PAGE_SIZE - 1));
-        if (!pte || !(*pte & PT_VALID)) 
-            return 0;
-
-        u64 phys = get_phys_from_pte(pte);
-        u64 offset = addr & (PAGE_SIZE - 1);
-        *((u8*)P2V(phys) + offset) = ((const u8*)src)[i];
-    }
+    if (copy_to_mm(mm, dest, src, strlen(src) + 1) != 0)
+        return 0;
 
     return dest;
 }
@@ -87,15 +51,13 @@ static u64 setup_user_stack(mm_struct_t* mm, const char* argv[], const char* env
         }
 
         if (!(*pte & PT_VALID)) {
-            u64 phys = pmm_alloc_frame();
+            u64 phys = pmm_alloc_zeroed_frame();
             if (!phys) {
                 kprintf("[ [REXEC [W] Failed to allocate stack page\n");
                 return 0;
             }
 
-            memset(P2V(phys), 0, PAGE_SIZE);
-
-            u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
+            u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER | PT_NG;
             entry |= (MT_NORMAL << 2);
             entry |= PT_AP_RW_EL0;  // User read/write
             entry |= PT_UXN;        // No execute on stack
@@ -104,15 +66,11 @@ static u64 setup_user_stack(mm_struct_t* mm, const char* argv[], const char* env
         }
     }
 
-    // Helper to write to user stack using physical addresses
+    // Helper to write to the new user stack, it isn't the live address space yet
     #define STACK_PUSH(val) do { \
         sp -= sizeof(u64); \
-        u64* pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), sp & ~(PAGE_SIZE-1)); \
-        if (pte && (*pte & PT_VALID)) { \
-            u64 phys = *pte & 0x0000FFFFFFFFF000ULL; \
-            u64 offset = sp & (PAGE_SIZE - 1); \
-            *(u64*)((u8*)P2V(phys) + offset) = (val); \
-        } \
+        u64 v = (val); \
+        copy_to_mm(mm, sp, &v, sizeof(u64)); \
     } while(0)
 
     u64 string_area_start = sp - 4096;  // Reserve 4KB for strings
@@ -120,23 +78,6 @@ static u64 setup_user_stack(mm_struct_t* mm, const char* argv[], const char* env
     u64 argv_ptrs[32] = {0};
     u64 envp_ptrs[32] = {0};
 
-    // Helper to copy string to user stack
-    #define COPY_STRING(str) ({ \
-        u64 len = strlen(str) + 1; \
-        u64 dest = string_ptr; \
-        string_ptr += len; \
-        for (u64 i = 0; i < len; i++) { \
-            u64 addr = dest + i; \
-            u64* pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), addr & ~(PAGE_SIZE-1)); \
-            if (pte && (*pte & PT_VALID)) { \
-                u64 phys = *pte & 0x0000FFFFFFFFF000ULL; \
-                u64 offset = addr & (PAGE_SIZE - 1); \
-                *((u8*)P2V(phys) + offset) = str[i]; \
-            } \
-        } \
-        dest; \
-    })
-
     // Copy argv strings
     for (int i = 0; i < argc && i < 32; i++) {
         argv_ptrs[i] = copy_string_to_user(mm, argv[i], string_ptr);
@@ -318,13 +259,8 @@ i64 sys_execve(const char* path, const char* argv[], const char* envp[]) {
     mm_struct_t* old_mm = proc->mm;
     proc->mm = new_mm;
 
-#ifdef ARM
     // Switch page table
-    asm volatile("msr ttbr0_el1, %0" :: "r"((u64)new_mm->page_table));
-    asm volatile("tlbi vmalle1is");
-    asm volatile("dsb ish");
-    asm volatile("isb");
-#endif
+    switch_mm(new_mm);
 
     char *kargv_strings[32] = {0};
     int argc = 0;
@@ -389,18 +325,8 @@ int exec_init(const char* path) {
         return -1;
     }
 
-#ifdef ARM
     // Switch to user page table
-    asm volatile(
-        "msr ttbr0_el1, %0\n"
-        "isb\n"
-        "tlbi vmalle1is\n"
-        "dsb ish\n"
-        "isb\n"
-        :: "r"((u64)proc->mm->page_table)
-        : "memory"
-    );
-#endif
+    switch_mm(proc->mm);
 
     u64 kernel_sp = (u64)current_task->stack_page + 4096;
     enter_usermode(elf_result.entry_point, user_sp, kernel_sp);
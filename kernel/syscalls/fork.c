@@ -18,7 +18,7 @@ extern void sched_enqueue_task(task_t *t);
 extern void sched_dequeue_task(task_t *t);
 
 task_t *task_clone(task_t *task, process_t *process) {
-    task_t *new = (task_t*)kmalloc(sizeof(task_t));
+    task_t *new = (task_t*)kmem_cache_alloc(task_cache);
     if (!new) {
         kprintf("[ [RSCHED [W] Error allocating memory for fork task\n");
         return NULL;
@@ -29,7 +29,7 @@ task_t *task_clone(task_t *task, process_t *process) {
     new->stack_page = kmalloc(4096);
     if (!new->stack_page) {
         kprintf("[ [RSCHED[W ] Failed to allocate stack!\n");
-        kfree(new);
+        kmem_cache_free(task_cache, new);
         return NULL;
     }
 
@@ -138,7 +138,6 @@ static int setup_signal_frame(trapframe_t* tf, int sig, sigaction_t* act) {
     if (!current_task || !current_task->proc || !current_task->proc->mm)
         return -1;
     
-    mm_struct_t* mm = current_task->proc->mm;
     signal_struct_t* siginfo = current_task->proc->signals;
     
     // Calculate frame location on user stack
@@ -146,20 +145,6 @@ static int setup_signal_frame(trapframe_t* tf, int sig, sigaction_t* act) {
     sp -= sizeof(sigframe_t);
     sp &= ~15;  // Align to 16 bytes
     
-    u64* pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)mm->page_table), sp);
-    if (!pte) return -1;
-    
-    if (!(*pte & PT_VALID)) {
-        u64 phys = pmm_alloc_frame();
-        if (!phys) return -1;
-        memset(P2V(phys), 0, PAGE_SIZE);
-        u64 entry = phys | PT_VALID | PT_AF | PT_PAGE | PT_SH_INNER;
-        entry |= (MT_NORMAL << 2);
-        entry |= PT_AP_RW_EL0;
-        entry |= PT_UXN;
-        *pte = entry;
-    }
-    
     sigframe_t frame;
     memset(&frame, 0, sizeof(frame));
     
@@ -176,24 +161,9 @@ static int setup_signal_frame(trapframe_t* tf, int sig, sigaction_t* act) {
     frame.retcode[0] = 0xD2800CE8;  // mov x8, #103
     frame.retcode[1] = 0xD4000001;  // svc #0
     
-    u64 frame_phys = (*pte & 0x0000FFFFFFFFF000ULL) + (sp & (PAGE_SIZE - 1));
-    
-    // Handle potential page boundary crossing
-    size_t first_page_bytes = PAGE_SIZE - (sp & (PAGE_SIZE - 1));
-    if (first_page_bytes >= sizeof(sigframe_t)) {
-        memcpy(P2V(frame_phys), &frame, sizeof(sigframe_t));
-    } else {
-        // Frame spans two pages
-        memcpy(P2V(frame_phys), &frame, first_page_bytes);
-        
-        u64 next_page = (sp & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
-        pte = vmm_get_pte_from_table_alloc((u64*)P2V((uintptr_t)mm->page_table), next_page);
-        if (!pte || !(*pte & PT_VALID)) return -1;
-        
-        u64 next_phys = *pte & 0x0000FFFFFFFFF000ULL;
-        memcpy(P2V(next_phys), (u8*)&frame + first_page_bytes, 
-               sizeof(sigframe_t) - first_page_bytes);
-    }
+    // Goes through the fault handler, so stack growth and COW pages are handled
+    if (copy_to_user((void*)sp, &frame, sizeof(sigframe_t)) != 0)
+        return -1;
     
     // Block signals during handler execution
     siginfo->blocked |= act->sa_mask;
@@ -393,7 +363,6 @@ i64 sys_sigreturn(trapframe_t* tf) {
     if (!current_task || !current_task->proc || !current_task->proc->mm)
         return -1;
     
-    mm_struct_t* mm = current_task->proc->mm;
     signal_struct_t* siginfo = current_task->proc->signals;
     if (!siginfo) return -1;
     
@@ -402,26 +371,8 @@ i64 sys_sigreturn(trapframe_t* tf) {
     
     // Read signal frame from user stack
     sigframe_t frame;
-    
-    u64* pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), sp);
-    if (!pte || !(*pte & PT_VALID)) return -1;
-    
-    u64 frame_phys = (*pte & 0x0000FFFFFFFFF000ULL) + (sp & (PAGE_SIZE - 1));
-    
-    size_t first_page_bytes = PAGE_SIZE - (sp & (PAGE_SIZE - 1));
-    if (first_page_bytes >= sizeof(sigframe_t)) {
-        memcpy(&frame, P2V(frame_phys), sizeof(sigframe_t));
-    } else {
-        memcpy(&frame, P2V(frame_phys), first_page_bytes);
-        
-        u64 next_page = (sp & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
-        pte = vmm_get_pte_from_table((u64*)P2V((uintptr_t)mm->page_table), next_page);
-        if (!pte || !(*pte & PT_VALID)) return -1;
-        
-        u64 next_phys = *pte & 0x0000FFFFFFFFF000ULL;
-        memcpy((u8*)&frame + first_page_bytes, P2V(next_phys),
-               sizeof(sigframe_t) - first_page_bytes);
-    }
+    if (copy_from_user(&frame, (const void*)sp, sizeof(sigframe_t)) != 0)
+        return -1;
     
     memcpy(tf->x, frame.x, sizeof(frame.x));
     tf->sp_el0 = frame.sp;
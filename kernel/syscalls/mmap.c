@@ -20,6 +20,19 @@
 #define MAP_FIXED       0x10
 #define MAP_ANONYMOUS   0x20
 #define MAP_ANON        MAP_ANONYMOUS
+#define MAP_POPULATE    0x8000  // Prefault the whole mapping
+
+// msync flags
+#define MS_ASYNC        0x1
+#define MS_INVALIDATE   0x2
+#define MS_SYNC         0x10
+
+// madvise advice
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
 
 // Error codes
 #define MAP_FAILED      ((void*)-1)
@@ -86,6 +99,10 @@ i64 sys_mmap(void *addr, size_t length, int prot, int flags, int fd, i64 offset)
         if (result == 0)
             return -ENOMEM;
 
+        // Best effort, whatever isn't populated faults in later as usual
+        if (flags & MAP_POPULATE)
+            vma_populate(mm, result, result + aligned_length);
+
         return (i64)result;
     }
     
@@ -120,9 +137,10 @@ i64 sys_mmap(void *addr, size_t length, int prot, int flags, int fd, i64 offset)
 
         new_vma->vm_file = file->inode;
         new_vma->vm_pgoff = offset;
+        vfs_retain(file->inode);
         
         if (vma_insert(mm, new_vma) < 0) {
-            kfree(new_vma);
+            vma_free(new_vma);
             return -ENOMEM;
         }
 
@@ -133,6 +151,9 @@ i64 sys_mmap(void *addr, size_t length, int prot, int flags, int fd, i64 offset)
             return -ENOMEM;
     }
     
+    if (flags & MAP_POPULATE)
+        vma_populate(mm, result, result + aligned_length);
+    
     return (i64)result;
 }
 
@@ -156,16 +177,75 @@ i64 sys_munmap(void *addr, size_t length) {
     if (start < USER_SPACE_START || end > USER_SPACE_END || end < start)
         return -EINVAL;
     
-    int result = vma_unmap(mm, start, end);
+    // vma_unmap flushes the TLB before freeing the frames
+    return vma_unmap(mm, start, end);
+}
+
+i64 sys_msync(void *addr, size_t length, int flags) {
+    if (!current_task || !current_task->proc || !current_task->proc->mm)
+        return -EINVAL;
+    
+    mm_struct_t *mm = current_task->proc->mm;
+    uintptr_t start = (uintptr_t)addr;
+    
+    if (start & (PAGE_SIZE - 1))
+        return -EINVAL;
+    
+    if (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC))
+        return -EINVAL;
+    
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC))
+        return -EINVAL;
+    
+    if (length == 0)
+        return 0;
+    
+    size_t aligned_length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t end = start + aligned_length;
     
-#ifdef ARM
-    // Flush TLB for the unmapped range
-    for (uintptr_t a = start; a < end; a += PAGE_SIZE)
-        asm volatile("tlbi vaale1is, %0" :: "r"(a >> 12));
+    if (start < USER_SPACE_START || end > USER_SPACE_END || end < start)
+        return -ENOMEM;
+    
+    // Mappings share the page cache, so there is nothing to invalidate and
+    // MS_ASYNC writes back right away as well
+    if (vma_sync(mm, start, end) < 0)
+        return -ENOMEM;
+    
+    return 0;
+}
 
-    asm volatile("dsb ish");
-    asm volatile("isb");
-#endif
+i64 sys_madvise(void *addr, size_t length, int advice) {
+    if (!current_task || !current_task->proc || !current_task->proc->mm)
+        return -EINVAL;
+    
+    mm_struct_t *mm = current_task->proc->mm;
+    uintptr_t start = (uintptr_t)addr;
+    
+    if (start & (PAGE_SIZE - 1))
+        return -EINVAL;
+    
+    if (length == 0)
+        return 0;
+    
+    size_t aligned_length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t end = start + aligned_length;
     
-    return result;
-}
\ No newline at end of file
+    if (start < USER_SPACE_START || end > USER_SPACE_END || end < start)
+        return -ENOMEM;
+    
+    int ret;
+    switch (advice) {
+        case MADV_NORMAL:     ret = vma_set_access_hint(mm, start, end, 0); break;
+        case MADV_RANDOM:     ret = vma_set_access_hint(mm, start, end, VMA_RAND_READ); break;
+        case MADV_SEQUENTIAL: ret = vma_set_access_hint(mm, start, end, VMA_SEQ_READ); break;
+        case MADV_WILLNEED:   ret = vma_populate(mm, start, end); break;
+        case MADV_DONTNEED:   ret = vma_discard(mm, start, end); break;
+        default: return -EINVAL;
+    }
+    
+    // Unmapped parts of the range, the mapped ones were still handled
+    if (ret < 0)
+        return -ENOMEM;
+    
+    return 0;
+}
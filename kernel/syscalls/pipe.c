@@ -140,7 +140,7 @@ static inode_ops pipe_read_ops = { 0 };
 static inode_ops pipe_write_ops = { 0 };
 
 inode_t *pipe_create_endpoint(pipe_t *pipe, int is_write) {
-    inode_t *node = (inode_t *)kmalloc(sizeof(inode_t));
+    inode_t *node = (inode_t *)kmem_cache_alloc(inode_cache);
     if (!node) return NULL;
 
     memset(node, 0, sizeof(inode_t));
@@ -172,8 +172,8 @@ i64 sys_pipe(int fd[2]) {
     inode_t *read_end  = pipe_create_endpoint(pipe, 0);
     inode_t *write_end = pipe_create_endpoint(pipe, 1);
     if (!read_end || !write_end) {
-        if (read_end)  kfree(read_end);
-        if (write_end) kfree(write_end);
+        if (read_end)  kmem_cache_free(inode_cache, read_end);
+        if (write_end) kmem_cache_free(inode_cache, write_end);
 
         kfree(pipe);
         return -1;
@@ -183,8 +183,8 @@ i64 sys_pipe(int fd[2]) {
     file_t *file1 = file_new(read_end, 1);
     current_task->proc->fd_table[kfd[0]] = file1;
     if (kfd[0] < 0) {
-        kfree(read_end);
-        kfree(write_end);
+        kmem_cache_free(inode_cache, read_end);
+        kmem_cache_free(inode_cache, write_end);
         kfree(pipe);
         return -1;
     }
@@ -194,7 +194,7 @@ i64 sys_pipe(int fd[2]) {
     current_task->proc->fd_table[kfd[1]] = file2;
     if (kfd[1] < 0) {
         fd_free(kfd[0]);
-        kfree(write_end);
+        kmem_cache_free(inode_cache, write_end);
         kfree(pipe);
         return -1;
     }
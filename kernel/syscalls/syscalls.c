@@ -65,7 +65,9 @@ struct timezone { int tz_minuteswest; int tz_dsttime; };
 #define SYS_REBOOT          55
 #define SYS_SYMLINK         57
 #define SYS_EXECVE          59
+#define SYS_MSYNC           65
 #define SYS_MUNMAP          73
+#define SYS_MADVISE         75
 #define SYS_GETCWD          76
 #define SYS_GETGROUPS       79
 #define SYS_SETGROUPS       80
@@ -112,6 +114,8 @@ extern i64 sys_chdir(const char *path);
 extern i64 sys_fchdir(int fd);
 extern i64 sys_lseek(int fd, i64 offset, int whence);
 extern i64 sys_munmap(void *addr, size_t length);
+extern i64 sys_msync(void *addr, size_t length, int flags);
+extern i64 sys_madvise(void *addr, size_t length, int advice);
 extern i64 sys_getcwd(char *buf, size_t size);
 extern i64 sys_dup2(int oldfd, int newfd);
 extern i64 sys_mkdir(const char *path, mode_t mode);
@@ -247,7 +251,9 @@ i64 syscall_handler(trapframe_t *tf, u64 syscall_num, u64 arg0, u64 arg1, u64 ar
         case SYS_REBOOT: ret = sys_reboot((int)arg0); break;
         case SYS_SYMLINK: ret = sys_symlink((const char*)arg0, (const char*)arg1); break;
         case SYS_EXECVE: ret = sys_execve((const char*)arg0, (const char**)arg1, (const char**)arg2); break;
+        case SYS_MSYNC: ret = sys_msync((void*)arg0, (size_t)arg1, (int)arg2); break;
         case SYS_MUNMAP: ret = sys_munmap((void*)arg0, (size_t)arg1); break;
+        case SYS_MADVISE: ret = sys_madvise((void*)arg0, (size_t)arg1, (int)arg2); break;
         case SYS_GETCWD: ret = sys_getcwd((char*)arg0, (size_t)arg1); break;
         case SYS_GETGROUPS: ret = sys_getgroups((int)arg0, (gid_t*)arg1); break;
         case SYS_SETGROUPS: ret = sys_setgroups((int)arg0, (gid_t*)arg1); break;
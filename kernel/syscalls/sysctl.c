@@ -4,6 +4,8 @@
 #include <timer.h>
 #include <syscalls.h>
 #include <sched.h>
+#include <heap.h>
+#include <vma.h>
 
 #define CTL_HW      1
 #define CTL_KERN    2
@@ -30,6 +32,9 @@
 #define VM_TOTAL        1
 #define VM_FREE         2
 #define VM_USED         3
+#define VM_KMALLOC      4
+#define VM_FAULT_AROUND 5
+#define VM_FAULT_AVOIDED 6
 
 typedef struct {
     u64 memsize;          // hw.memsize - Physical memory in bytes
@@ -265,6 +270,59 @@ i64 sys_sysctl(int *name, u32 namelen, void *oldp, u64 *oldlenp, void *newp, u64
                     return 0;
             }
             break;
+
+        case CTL_VM:
+            switch (item) {
+                case VM_FAULT_AROUND:
+                    // Readable and writable, in pages
+                    if (oldp && oldlenp && *oldlenp >= sizeof(u32)) {
+                        *(u32*)oldp = fault_around_pages;
+                        *oldlenp = sizeof(u32);
+                    }
+
+                    if (newp && newlen == sizeof(u32)) {
+                        u32 pages = *(u32*)newp;
+                        if (pages > 512 || (pages & (pages - 1)))
+                            return -1;
+
+                        __atomic_store_n(&fault_around_pages, pages, __ATOMIC_RELAXED);
+                    }
+
+                    return 0;
+
+                case VM_FAULT_AVOIDED:
+                    if (oldp && oldlenp && *oldlenp >= sizeof(u64)) {
+                        *(u64*)oldp = __atomic_load_n(&fault_around_avoided, __ATOMIC_RELAXED);
+                        *oldlenp = sizeof(u64);
+                    }
+
+                    return 0;
+
+#ifdef KMALLOC_PROFILE
+                case VM_KMALLOC:
+                    // Array of kmalloc_site_t, a NULL oldp just reports the size needed
+                    if (oldlenp) {
+                        u32 count = kmalloc_profile_read(NULL, 0);
+                        if (oldp) {
+                            // More than PROF_SITES can never come back, don't let the user size the buffer
+                            u32 max = *oldlenp / sizeof(kmalloc_site_t);
+                            if (max > PROF_SITES) max = PROF_SITES;
+                            kmalloc_site_t *sites = kmalloc((max ? max : 1) * sizeof(kmalloc_site_t));
+                            if (!sites) return -1;
+
+                            count = kmalloc_profile_read(sites, max);
+                            if (count > max) count = max;
+                            memcpy(oldp, sites, count * sizeof(kmalloc_site_t));
+                            kfree(sites);
+                        }
+
+                        *oldlenp = count * sizeof(kmalloc_site_t);
+                    }
+
+                    return 0;
+#endif
+            }
+            break;
     }
 
     return -1; // Unknown sysctl
@@ -6,9 +6,11 @@
 #include <sync.h>
 #include <vmm.h>
 #include <vma.h>
+#include <asid.h>
 #include <file.h>
 #include <signal.h>
 #include <tty.h>
+#include <pmm.h>
 
 #define PID_HASH_SIZE 1024
 
@@ -28,6 +30,8 @@ u32 active_priorities = 0; // Bitmask for priorities
 
 static process_t *pid_hash[PID_HASH_SIZE];
 
+kmem_cache_t *task_cache = NULL;
+
 // Store the kernel's root page table for TTBR1
 static u64 kernel_ttbr1 = 0;
 
@@ -82,6 +86,9 @@ void sched_unlock_release() {
 
 void idle() {
     while (true) {
+        // Spend idle time pre-zeroing frames for page faults, until real work shows up
+        while (active_priorities <= (1 << IDLE) && pmm_refill_zeroed());
+
 #ifdef ARM
         asm volatile("wfi");
 #else
@@ -92,6 +99,9 @@ void idle() {
 }
 
 void sched_init() {
+    // task_t is touched on every context switch, keep each one on its own lines
+    task_cache = kmem_cache_create("task_t", sizeof(task_t), CACHE_LINE_SIZE, NULL);
+
     // Clears all queues
     for (int i = 0; i < COUNT; i++) {
         runqueues[i] = NULL;
@@ -167,7 +177,7 @@ process_t *process_create(const char *name, void (*entry_point)(), task_priority
 void task_create(void (*entry_point)(), task_priority priority, struct process *proc) {
     if (priority >= COUNT) priority = NORMAL;
 
-    task_t* t = (task_t*)kmalloc(sizeof(task_t));
+    task_t* t = (task_t*)kmem_cache_alloc(task_cache);
     if (!t) return;
     memset(t, 0, sizeof(task_t));
     
@@ -175,7 +185,7 @@ void task_create(void (*entry_point)(), task_priority priority, struct process *
     t->stack_page = kmalloc(4096);
     if (!t->stack_page) {
         kprintf("[ [RSCHED[W ] Failed to allocate stack!\n");
-        kfree(t);
+        kmem_cache_free(task_cache, t);
         return;
     }
 
@@ -310,37 +320,18 @@ void schedule() {
 
         mm_struct_t *next_mm = (next_task->proc) ? next_task->proc->mm : NULL;
 
-        cpu_switch_to(prev_task, next_task);
+        // Kernel threads keep running on the previous mm, switch_mm skips same-mm reloads
+        if (next_mm) switch_mm(next_mm);
 
-        if (current_task->proc && current_task->proc->mm) {
-            asm volatile(
-                "msr ttbr0_el1, %0\n"
-                "isb\n"
-                "tlbi vmalle1is\n"
-                "dsb ish\n"
-                "isb\n"
-                :: "r"((u64)current_task->proc->mm->page_table)
-                : "memory"
-            );
-        }
+        cpu_switch_to(prev_task, next_task);
     }
 
     spinlock_release_irqrestore(&sched_lock, flags);
 }
 
 void switch_to_child_mm() {
-    if (current_task && current_task->proc && current_task->proc->mm) {
-        u64 ttbr = (u64)current_task->proc->mm->page_table;
-        asm volatile(
-            "msr ttbr0_el1, %0\n"
-            "isb\n"
-            "tlbi vmalle1is\n"
-            "dsb ish\n"
-            "isb\n"
-            :: "r"(ttbr)
-            : "memory"
-        );
-    }
+    if (current_task && current_task->proc && current_task->proc->mm)
+        switch_mm(current_task->proc->mm);
 }
 
 void pid_hash_insert(process_t *proc) {
@@ -60,4 +60,72 @@ void mutex_release(mutex_t* mutex) {
     wake_up(&mutex->wait_list);
 
     spinlock_release_irqrestore(&mutex->lock, flags);
-}
\ No newline at end of file
+}
+
+void rwsem_init(rwsem_t* sem) {
+    sem->lock = 0;
+    sem->readers = 0;
+    sem->writer = false;
+    sem->writers_waiting = 0;
+    sem->wait_list = NULL;
+}
+
+// Wakes every waiter, each one re-checks whether it can go
+static void rwsem_wake_all(rwsem_t* sem) {
+    while (sem->wait_list)
+        wake_up(&sem->wait_list);
+}
+
+void rwsem_read_acquire(rwsem_t* sem) {
+    while (true) {
+        u32 flags = spinlock_acquire_irqsave(&sem->lock);
+
+        if (!sem->writer && !sem->writers_waiting) {
+            sem->readers++;
+            spinlock_release_irqrestore(&sem->lock, flags);
+            return;
+        }
+
+        sleep_on(&sem->wait_list, &sem->lock);
+    }
+}
+
+void rwsem_read_release(rwsem_t* sem) {
+    u32 flags = spinlock_acquire_irqsave(&sem->lock);
+
+    if (--sem->readers == 0)
+        rwsem_wake_all(sem);
+
+    spinlock_release_irqrestore(&sem->lock, flags);
+}
+
+void rwsem_write_acquire(rwsem_t* sem) {
+    bool waited = false;
+
+    while (true) {
+        u32 flags = spinlock_acquire_irqsave(&sem->lock);
+
+        if (!sem->writer && sem->readers == 0) {
+            sem->writer = true;
+            if (waited) sem->writers_waiting--;
+            spinlock_release_irqrestore(&sem->lock, flags);
+            return;
+        }
+
+        if (!waited) {
+            sem->writers_waiting++;
+            waited = true;
+        }
+
+        sleep_on(&sem->wait_list, &sem->lock);
+    }
+}
+
+void rwsem_write_release(rwsem_t* sem) {
+    u32 flags = spinlock_acquire_irqsave(&sem->lock);
+
+    sem->writer = false;
+    rwsem_wake_all(sem);
+
+    spinlock_release_irqrestore(&sem->lock, flags);
+}
@@ -13,6 +13,17 @@
 #define MAP_FIXED       0x10
 #define MAP_ANONYMOUS   0x20
 #define MAP_ANON        MAP_ANONYMOUS
+#define MAP_POPULATE    0x8000
+
+#define MS_ASYNC        0x1
+#define MS_INVALIDATE   0x2
+#define MS_SYNC         0x10
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
 
 #define MAP_FAILED      ((void*)-1)
 #define EINVAL          22
@@ -24,5 +35,7 @@
 void *mmap(void *addr, size_t len, int prot, int flags,
        int fildes, off_t off);
 int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+int madvise(void *addr, size_t len, int advice);
 
 #endif
\ No newline at end of file
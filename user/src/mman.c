@@ -9,6 +9,26 @@ int munmap(void *addr, size_t len) {
     return (int)(long)x0;
 }
 
+int msync(void *addr, size_t len, int flags) {
+    register void *x0 asm("x0") = addr;
+    register size_t x1 asm("x1") = len;
+    register int x2 asm("x2") = flags;
+    register long x8 asm("x8") = 65;
+    asm volatile("svc #0"
+        : "+r"(x0) : "r"(x1), "r"(x2), "r"(x8) : "memory");
+    return (int)(long)x0;
+}
+
+int madvise(void *addr, size_t len, int advice) {
+    register void *x0 asm("x0") = addr;
+    register size_t x1 asm("x1") = len;
+    register int x2 asm("x2") = advice;
+    register long x8 asm("x8") = 75;
+    asm volatile("svc #0"
+        : "+r"(x0) : "r"(x1), "r"(x2), "r"(x8) : "memory");
+    return (int)(long)x0;
+}
+
 void *mmap(void *addr, size_t len, int prot, int flags,
        int fildes, off_t off) {
     register void *x0 asm("x0") = addr;